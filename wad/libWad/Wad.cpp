@@ -2,19 +2,205 @@
 #include <iostream>
 #include <cstring>
 #include <stack>
-#include <regex>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// 64-bit FNV-1a over lump data, used to key the dedup index
+static uint64_t hashLump(const char *data, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// CRC32C (Castagnoli) for the integrity sidecar. On x86-64 the SSE4.2 crc32 instruction is
+// used when the CPU has it; on ARMv8 the crc32c instructions only when built with +crc
+// (e.g. -march=armv8-a+crc). Everything else uses a lookup table.
+static const std::array<uint32_t, 256> crc32cTable = [] {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        crc = crc32cTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char *data, size_t length) {
+    uint64_t crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+    for (; length > 0; ++data, --length) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+static const bool hardwareCrc = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char *data, size_t length) {
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; length > 0; ++data, --length) {
+        crc = __crc32cb(crc, *data);
+    }
+    return crc;
+}
+static const bool hardwareCrc = true;
+#else
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char *data, size_t length) {
+    return crc32cSoftware(crc, data, length);
+}
+static const bool hardwareCrc = false;
+#endif
+
+// crc is the CRC32C of the bytes before data (0 for none), so checksums can be extended
+static uint32_t crc32c(const char *data, size_t length, uint32_t crc = 0) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+    crc = ~crc;
+    crc = hardwareCrc ? crc32cHardware(crc, bytes, length) : crc32cSoftware(crc, bytes, length);
+    return ~crc;
+}
+
+
+Node::Node(uint64_t name, size_t offset, size_t length, bool isDirectory) : name(name), length(length), isDirectory(isDirectory) {
+    if (length > 0) {
+        extents.push_back({offset, length});
+    }
+}
+
+ChildList::ChildList(const std::vector<value_type> &children) : count(children.size()) {
+    // build bottom-up: full leaves first, then full inner blocks until one is left
+    std::vector<std::shared_ptr<const Block>> level;
+    for (size_t i = 0; i < children.size(); i += WIDTH) {
+        auto leaf = std::make_shared<Block>();
+        leaf->nodes.assign(children.begin() + i, children.begin() + std::min(children.size(), i + WIDTH));
+        level.push_back(leaf);
+    }
+    while (level.size() > 1) {
+        std::vector<std::shared_ptr<const Block>> parents;
+        for (size_t i = 0; i < level.size(); i += WIDTH) {
+            auto block = std::make_shared<Block>();
+            block->blocks.assign(level.begin() + i, level.begin() + std::min(level.size(), i + WIDTH));
+            parents.push_back(block);
+        }
+        level.swap(parents);
+        shift += BITS;
+    }
+    if (!level.empty()) {
+        root = level[0];
+    }
+}
+
+const ChildList::value_type& ChildList::operator[](size_t index) const {
+    const Block* block = root.get();
+    for (unsigned level = shift; level > 0; level -= BITS) {
+        block = block->blocks[(index >> level) & (WIDTH - 1)].get();
+    }
+    return block->nodes[index & (WIDTH - 1)];
+}
 
+void ChildList::set(size_t index, value_type child) {
+    root = setIn(root, shift, index, std::move(child));
+}
 
-Node::Node(std::string filename, size_t offset, size_t length, bool isDirectory) : filename(filename), offset(offset), length(length), isDirectory(isDirectory) {}
+void ChildList::push_back(value_type child) {
+    // a full tree gets a new root holding the old one as its first block
+    if (root != nullptr && count == (WIDTH << shift)) {
+        auto grown = std::make_shared<Block>();
+        grown->blocks.push_back(root);
+        root = grown;
+        shift += BITS;
+    }
+    root = setIn(root, shift, count, std::move(child));
+    count++;
+}
 
-Descriptor::Descriptor(const std::string &name, size_t offset, size_t length) {
+std::shared_ptr<const ChildList::Block> ChildList::setIn(const std::shared_ptr<const Block> &block, unsigned shift,
+                                                         size_t index, value_type child) {
+    // copy the block on index's path; every other block stays shared
+    auto copy = block != nullptr ? std::make_shared<Block>(*block) : std::make_shared<Block>();
+    size_t slot = (index >> shift) & (WIDTH - 1);
+    if (shift == 0) {
+        if (slot >= copy->nodes.size()) {
+            copy->nodes.resize(slot + 1);
+        }
+        copy->nodes[slot] = std::move(child);
+    }
+    else {
+        if (slot >= copy->blocks.size()) {
+            copy->blocks.resize(slot + 1);
+        }
+        copy->blocks[slot] = setIn(copy->blocks[slot], shift - BITS, index, std::move(child));
+    }
+    return copy;
+}
+
+size_t Snapshot::shardOf(const std::string &path) {
+    // low bits pick the group, the next bits the shard within it
+    return std::hash<std::string>{}(path) % (SHARDS * SHARDS);
+}
+
+const Node* Snapshot::find(const std::string &path) const {
+    size_t index = shardOf(path);
+    const auto& group = pathMap[index % SHARDS];
+    if (group == nullptr || (*group)[index / SHARDS] == nullptr) {
+        return nullptr;
+    }
+    const PathShard &shard = *(*group)[index / SHARDS];
+    auto it = shard.find(path);
+    return it == shard.end() ? nullptr : it->second.get();
+}
+
+void Snapshot::set(const std::string &path, std::shared_ptr<const Node> node) {
+    // copy-on-write: the group and shard may still be shared with published versions
+    size_t index = shardOf(path);
+    const auto& oldGroup = pathMap[index % SHARDS];
+    auto group = oldGroup != nullptr ? std::make_shared<ShardGroup>(*oldGroup) : std::make_shared<ShardGroup>();
+    const auto& oldShard = (*group)[index / SHARDS];
+    auto shard = oldShard != nullptr ? std::make_shared<PathShard>(*oldShard) : std::make_shared<PathShard>();
+    (*shard)[path] = node;
+    (*group)[index / SHARDS] = shard;
+    pathMap[index % SHARDS] = group;
+}
+
+Descriptor::Descriptor(uint64_t name, size_t offset, size_t length) {
     this->name = name;
     this->offset = offset;
     this->length = length;
 
 }
 Descriptor::Descriptor() {
-    this->name = "";
+    this->name = 0;
     this->offset = 0;
     this->length = 0;
 }
@@ -23,7 +209,16 @@ Descriptor::Descriptor() {
 Wad::Wad(const std::string &path) {
     // open file
     wad.open(path, std::ios::in | std::ios::out | std::ios::binary);
-    pathMap.clear();
+    fd = open(path.c_str(), O_RDONLY);
+    wadPath = path;
+    crcPath = path + ".crc";
+
+    // only the holder of the lock writes the sidecar; a second process would race its
+    // appends and compaction renames
+    exclusive = fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0;
+    if (fd >= 0 && !exclusive) {
+        std::cout << path << " is open in another process; checksums will not be saved" << std::endl;
+    }
  
     // read in header content & set variables
     char magic[4];
@@ -41,88 +236,161 @@ Wad::Wad(const std::string &path) {
         wad.read(reinterpret_cast<char*>(&desc.length), 4);
         char name[8];
         wad.read(name, 8);
-        desc.name = std::string(name, strnlen(name, 8));
+        desc.name = LumpName::pack(name);
         descriptors[i] = desc;
+        if (desc.length > 0) {
+            lumpRefs[desc.offset]++;
+            dataEnd = std::max(dataEnd, desc.offset + desc.length);
+        }
         //td::cout << "Descriptor " << i << ": Name: " << desc.name << " Offset: " << desc.offset << " Length: " << desc.length << std::endl;
     }
+    loaded = fd >= 0 && !wad.fail();
 
-    // create stack and set root node
-    std::stack<Node*> dirStack;
-    root = new Node{"root", 0, 0, true};
-    dirStack.push(root);
+    loadChecksums();
+    current.store(buildSnapshot(&descriptorIndex));
+    linkDescriptorIndex();
+    //std::cout << "Tree end constructor:" << std::endl;
+    //printTree(getRoot().get());
+}
 
-    // use regex for directory matching
-    std::regex mapMarkerRegex(R"(E[0-9]M[0-9])");
-    std::regex namespaceStartRegex(R"((.+)_START)");
-    std::regex namespaceEndRegex(R"((.+)_END)");
 
-    pathMap["/"] = root;
+Snapshot* Wad::buildSnapshot(std::unordered_map<std::string, size_t>* fileDescriptors) const {
+// Builds a complete version of the tree and path index from the descriptor list. If
+// fileDescriptors is given, it is refilled with the first descriptor of every file.
+    if (fileDescriptors != nullptr) {
+        fileDescriptors->clear();
+    }
+    // build the first snapshot; nodes stay mutable until it is published
+    std::vector<std::shared_ptr<Snapshot::PathShard>> shards(Snapshot::SHARDS * Snapshot::SHARDS);
+    auto index = [&](const std::string& nodePath, const std::shared_ptr<Node>& node) {
+        auto& shard = shards[Snapshot::shardOf(nodePath)];
+        if (shard == nullptr) {
+            shard = std::make_shared<Snapshot::PathShard>();
+        }
+        (*shard)[nodePath] = node;
+        // an extent is checked only if every one of its blocks has a checksum
+        for (auto& extent : node->extents) {
+            for (size_t k = 0; k < extent.blocks(); ++k) {
+                auto it = checksums.find(extent.offset + k * CRC_BLOCK);
+                if (it == checksums.end() || it->second.length != extent.blockLength(k)) {
+                    extent.crcs.clear();
+                    break;
+                }
+                extent.crcs.push_back(it->second.crc);
+            }
+        }
+    };
 
-    // iterate through descriptors and handle directory types and plain files (4 cases)
-    for (size_t i = 0; i < descriptors.size(); ++i) {
-        auto& desc = descriptors[i];
-        Node* currDir = dirStack.top();
+    // create stack and set root node; pathStack mirrors dirStack with each directory's full path
+    std::stack<std::shared_ptr<Node>> dirStack;
+    std::stack<std::string> pathStack;
+    auto root = std::make_shared<Node>(LumpName::pack("root"), 0, 0, true);
+    dirStack.push(root);
+    pathStack.push("/");
 
-        // Reconstruct the current path from the directory stack
-        std::string currPath = "/";
-        std::stack<Node*> tempStack = dirStack;
-        std::vector<std::string> pathComponents;
+    index("/", root);
 
-        while (!tempStack.empty()) {
-            pathComponents.push_back(tempStack.top()->filename);
-            tempStack.pop();
+    // children are gathered in plain vectors and turned into lists once complete
+    std::unordered_map<Node*, std::vector<std::shared_ptr<const Node>>> children;
+    auto adopt = [&](Node* dir, const std::shared_ptr<Node>& child) {
+        auto& list = children[dir];
+        child->slot = list.size();
+        list.push_back(child);
+    };
+
+    // iterate through descriptors and handle directory types and plain files (4 cases)
+    // continuation descriptors (empty name) right after a lump are further extents of it
+    auto addContinuations = [&](Node& node, size_t& i) {
+        while (i + 1 < descriptors.size() && descriptors[i + 1].name == 0 && descriptors[i + 1].length > 0) {
+            const auto& extent = descriptors[++i];
+            node.extents.push_back({extent.offset, extent.length});
+            node.length += extent.length;
         }
+    };
 
-        for (auto it = pathComponents.rbegin(); it != pathComponents.rend(); ++it) {
-            if (*it != "root") {
-                currPath += *it + "/";
-            }
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        auto& desc = descriptors[i];
+        if (desc.isSpare()) {
+            continue;
         }
+        Node* currDir = dirStack.top().get();
+        const std::string& currPath = pathStack.top();
 
         // Check map markers
-        if (std::regex_match(desc.name, mapMarkerRegex)) {
-            Node* mapDir = new Node{desc.name, 0, 0, true};
-            pathMap[currPath + mapDir->filename + "/"] = mapDir;
-            currDir->children.push_back(mapDir);
-            dirStack.push(mapDir);
+        if (LumpName::isMapMarker(desc.name)) {
+            auto mapDir = std::make_shared<Node>(desc.name, 0, 0, true);
+            std::string mapPath = currPath + LumpName::unpack(mapDir->name) + "/";
+            index(mapPath, mapDir);
+            adopt(currDir, mapDir);
 
             // Read in next 10 descriptors and add to tree
             for (int j = 0; j < 10; ++j) {
-                if (++i >= descriptors.size()) {
+                while (++i < descriptors.size() && descriptors[i].isSpare()) {
+                }
+                if (i >= descriptors.size()) {
                     //std::cout << "max descriptors reached" << std::endl;
                     break;
                 }
                 const auto& mapDesc = descriptors[i];
-                Node* mapNode = new Node{mapDesc.name, mapDesc.offset, mapDesc.length, false};
-                mapDir->children.push_back(mapNode);
-                pathMap[currPath + mapDir->filename + "/" + mapNode->filename] = mapNode;
+                auto mapNode = std::make_shared<Node>(mapDesc.name, mapDesc.offset, mapDesc.length, false);
+                std::string nodePath = mapPath + LumpName::unpack(mapNode->name);
+                if (fileDescriptors != nullptr) {
+                    (*fileDescriptors)[nodePath] = i;
+                }
+                addContinuations(*mapNode, i);
+                adopt(mapDir.get(), mapNode);
+                index(nodePath, mapNode);
             }
-            dirStack.pop();
         }
         // Check namespace start markers
-        else if (std::regex_search(desc.name, namespaceStartRegex)) {
-            size_t pos = desc.name.find("_START");
-            std::string truncatedName = (pos != std::string::npos) ? desc.name.substr(0, pos) : desc.name;
-            Node* nsDir = new Node{truncatedName, 0, 0, true};
-            currDir->children.push_back(nsDir);
+        else if (LumpName::hasSuffix(desc.name, LumpName::START)) {
+            auto nsDir = std::make_shared<Node>(LumpName::stripSuffix(desc.name, LumpName::START), 0, 0, true);
+            std::string nsPath = currPath + LumpName::unpack(nsDir->name) + "/";
+            adopt(currDir, nsDir);
+            index(nsPath, nsDir);
             dirStack.push(nsDir);
-            pathMap[currPath + nsDir->filename + "/"] = nsDir;
+            pathStack.push(nsPath);
 
-            //std::cout << "Directory created: " << currPath + nsDir->filename << std::endl;
+            //std::cout << "Directory created: " << nsPath << std::endl;
         }
         // Check namespace end markers
-        else if (std::regex_search(desc.name, namespaceEndRegex)) {
+        else if (LumpName::hasSuffix(desc.name, LumpName::END)) {
             dirStack.pop();
+            pathStack.pop();
         }
         // Handle regular files
         else {
-            Node* fileNode = new Node{desc.name, desc.offset, desc.length, false};
-            currDir->children.push_back(fileNode);
-            pathMap[currPath + fileNode->filename] = fileNode;
+            auto fileNode = std::make_shared<Node>(desc.name, desc.offset, desc.length, false);
+            std::string nodePath = currPath + LumpName::unpack(fileNode->name);
+            if (fileDescriptors != nullptr) {
+                (*fileDescriptors)[nodePath] = i;
+            }
+            addContinuations(*fileNode, i);
+            adopt(currDir, fileNode);
+            index(nodePath, fileNode);
         }
     }
-    //std::cout << "Tree end constructor:" << std::endl;
-    //printTree(root);
+
+    for (const auto& [dir, list] : children) {
+        dir->children = ChildList(list);
+    }
+
+    Snapshot* snapshot = new Snapshot;
+    snapshot->root = root;
+    for (size_t group = 0; group < Snapshot::SHARDS; ++group) {
+        std::shared_ptr<Snapshot::ShardGroup> shardGroup;
+        for (size_t i = 0; i < Snapshot::SHARDS; ++i) {
+            const auto& shard = shards[group + i * Snapshot::SHARDS];
+            if (shard != nullptr) {
+                if (shardGroup == nullptr) {
+                    shardGroup = std::make_shared<Snapshot::ShardGroup>();
+                }
+                (*shardGroup)[i] = shard;
+            }
+        }
+        snapshot->pathMap[group] = shardGroup;
+    }
+    return snapshot;
 }
 
 
@@ -131,19 +399,167 @@ Wad* Wad::loadWad(const std::string &path) {
 }
 
 Wad::~Wad() {
-    if (root != nullptr) {
-        delete root;
-    } 
+    // no reader may still be inside a call once the Wad is destroyed
+    delete current.load();
+    for (const auto& [epoch, snapshot] : retired) {
+        delete snapshot;
+    }
+    retired.clear();
 
     if (wad.is_open()) {
         wad.flush();
     }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (crcFd >= 0) {
+        close(crcFd);
+    }
 
-    pathMap.clear();
     numDescriptors = 0;
     descriptorOffset = 0;      
 }
 
+Wad::ReadGuard::ReadGuard(Wad &wad) : wad(wad) {
+    // claim a free slot and announce the epoch before loading the snapshot, so a
+    // writer that retires this snapshot afterwards will see the reader
+    slot = std::hash<std::thread::id>{}(std::this_thread::get_id()) % READER_SLOTS;
+    while (true) {
+        uint64_t expected = 0;
+        uint64_t epoch = wad.globalEpoch.load();
+        if (wad.readers[slot].epoch.compare_exchange_weak(expected, epoch)) {
+            break;
+        }
+        slot = (slot + 1) % READER_SLOTS;
+    }
+    snapshot = wad.current.load();
+}
+
+Wad::ReadGuard::~ReadGuard() {
+    wad.readers[slot].epoch.store(0);
+}
+
+void Wad::publish(const std::string &path, std::shared_ptr<Node> node) {
+// Installs node at path in a new version: every ancestor up to the root is copied with the
+// changed child swapped in, their index entries are replaced, and the new version replaces
+// the current one. Children lists and index shards are persistent, so each level copies a
+// few small blocks rather than all siblings. Must be called with writeMutex held.
+    const Snapshot* snap = current.load();
+    Snapshot* next = new Snapshot(*snap);
+
+    std::string key = path;
+    const Node* old = snap->find(key);
+    std::shared_ptr<Node> child = node;
+    while (key != "/") {
+        // parent key keeps its trailing slash: "/F/F1/FLOOR1" -> "/F/F1/", "/ab/" -> "/"
+        std::string parentKey = key.substr(0, key.find_last_of('/', key.length() - 2) + 1);
+        const Node* parent = snap->find(parentKey);
+
+        // a replaced node is a copy of the old one and keeps its slot
+        auto copy = std::make_shared<Node>(*parent);
+        if (old != nullptr) {
+            copy->children.set(child->slot, child);
+        }
+        else {
+            child->slot = copy->children.size();
+            copy->children.push_back(child);
+        }
+        next->set(key, child);
+
+        key = parentKey;
+        old = parent;
+        child = copy;
+    }
+    next->root = child;
+    next->set("/", child);
+    install(next);
+}
+
+void Wad::install(Snapshot* next) {
+// Swaps next in as the current version and retires the previous one.
+    next->version = current.load()->version + 1;
+    const Snapshot* previous = current.exchange(next);
+    uint64_t epoch = globalEpoch.fetch_add(1) + 1;
+    retired.emplace_back(epoch, previous);
+    reclaim();
+
+    // superseded sidecar records pile up with every write; the table matches the logged
+    // checksums here, so this is where the log is rewritten once they dominate it
+    if (exclusive && crcRecords > 2 * checksums.size() + 4096) {
+        compactChecksums();
+    }
+}
+
+void Wad::reclaim() {
+// Frees retired versions no reader can still hold: a version retired at epoch E is only
+// visible to readers that entered before E.
+    uint64_t oldest = UINT64_MAX;
+    for (const auto& reader : readers) {
+        uint64_t epoch = reader.epoch.load();
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    auto keep = retired.begin();
+    for (auto it = retired.begin(); it != retired.end(); ++it) {
+        if (it->first <= oldest) {
+            delete it->second;
+        }
+        else {
+            *keep++ = *it;
+        }
+    }
+    retired.erase(keep, retired.end());
+}
+
+std::shared_ptr<const Node> Wad::getRoot() {
+    ReadGuard guard(*this);
+    return guard.snapshot->root;
+}
+
+uint64_t Wad::getVersion() {
+    ReadGuard guard(*this);
+    return guard.snapshot->version;
+}
+
+size_t Wad::getMemoryUsage() {
+// Approximate heap bytes held by the current tree, path index and writer state.
+// Used to budget memory when many archives share one process.
+    size_t bytes = sizeof(Wad);
+    {
+        ReadGuard guard(*this);
+        bytes += Snapshot::SHARDS * sizeof(Snapshot::ShardGroup);
+        guard.snapshot->forEachShard([&](const Snapshot::PathShard &shard) {
+            bytes += sizeof(Snapshot::PathShard) + shard.bucket_count() * sizeof(void*);
+            for (const auto& [path, node] : shard) {
+                // hash node + out-of-line key + shared_ptr control block and node
+                bytes += sizeof(Snapshot::PathShard::value_type) + 2 * sizeof(void*);
+                bytes += path.capacity() > 15 ? path.capacity() + 1 : 0;
+                bytes += 16 + sizeof(Node) + node->children.size() * sizeof(std::shared_ptr<const Node>) +
+                         node->extents.capacity() * sizeof(Extent);
+                for (const auto& extent : node->extents) {
+                    bytes += extent.crcs.capacity() * sizeof(uint32_t);
+                }
+            }
+        });
+    }
+
+    std::lock_guard<std::mutex> lock(writeMutex);
+    bytes += descriptors.capacity() * sizeof(Descriptor);
+    bytes += lumpRefs.size() * (sizeof(std::pair<const size_t, int>) + 4 * sizeof(void*));
+    for (const auto& [hash, offsets] : lumpIndex) {
+        bytes += sizeof(std::pair<const uint64_t, std::vector<size_t>>) + 2 * sizeof(void*) + offsets.capacity() * sizeof(size_t);
+    }
+    bytes += checksums.size() * (sizeof(std::pair<const size_t, Checksum>) + 2 * sizeof(void*));
+    bytes += descriptorSlots.capacity() * sizeof(size_t*);
+    for (const auto& [path, index] : descriptorIndex) {
+        bytes += sizeof(std::pair<const std::string, size_t>) + 2 * sizeof(void*);
+        bytes += path.capacity() > 15 ? path.capacity() + 1 : 0;
+    }
+    return bytes;
+}
+
 std::string Wad::getMagic() {
     return magic; 
 }
@@ -153,10 +569,10 @@ bool Wad::isContent(const std::string &path) {
 // Will return true if it is a valid path to an existing content file.
 // Will return false if it is a valid path to a directory, or if the path is invalid (nonexistent)
 
-    auto it = pathMap.find(path);
+    ReadGuard guard(*this);
+    const Node* node = guard.snapshot->find(path);
     //std::cout << "Searching for path: " << path << std::endl;
-    if (it != pathMap.end()) {
-        Node* node = it->second;
+    if (node != nullptr) {
         //std::cout << "Found path: " << path << ", isDirectory: " << (node->isDirectory ? "true" : "false") << std::endl;
         return !node->isDirectory;
     }
@@ -173,17 +589,17 @@ bool Wad::isDirectory(const std::string &path) {
         //std::cout << "entered" << std::endl;
         normPath += "/";
     }
-    auto it = pathMap.find(normPath);
+    ReadGuard guard(*this);
+    const Node* node = guard.snapshot->find(normPath);
 
-    if (it != pathMap.end()) {
-        Node* node = it->second;
+    if (node != nullptr) {
         //std::cout << "Found path: " << path << ", isDirectory: " << (node->isDirectory ? "true" : "false") << std::endl;
         return node->isDirectory;
     }
     normPath = path;
-    auto itWithoutSlash = pathMap.find(normPath);
-    if (itWithoutSlash != pathMap.end()) {
-        return itWithoutSlash->second->isDirectory;
+    const Node* nodeWithoutSlash = guard.snapshot->find(normPath);
+    if (nodeWithoutSlash != nullptr) {
+        return nodeWithoutSlash->isDirectory;
     }
 
     return false;
@@ -191,11 +607,11 @@ bool Wad::isDirectory(const std::string &path) {
 
 int Wad::getSize(const std::string &path) {
 // Returns the size of the file at path. If path is points to a directory or is invalid, returns -1.
-    auto it = pathMap.find(path);
+    ReadGuard guard(*this);
+    const Node* node = guard.snapshot->find(path);
     //std::cout << "Searching for path: " << path << std::endl;
-    //printPathMap(pathMap);
-    if (it != pathMap.end()) {
-        Node* node = it->second;
+    //printPathMap();
+    if (node != nullptr) {
         if (!node->isDirectory) {
             return static_cast<int>(node->length);
         }
@@ -207,23 +623,63 @@ int Wad::getContents(const std::string &path, char *buffer, int length, int offs
 // Given a valid path to an existing content file, it will read length amount of bytes from the file’s lump data,
 // starting at offset. Returns amount of bytes successfully copied. Returns -1 if path is directory/invalid.
 
-    auto it = pathMap.find(path);
-    if (it != pathMap.end()) {
-        Node* node = it->second;
-        if (node->isDirectory) {
+    uint64_t version;
+    size_t damaged;
+    {
+        ReadGuard guard(*this);
+        const Node* node = guard.snapshot->find(path);
+        if (node == nullptr || node->isDirectory) {
             return -1;
         }
         if (offset >= static_cast<int>(node->length)) {
             return 0;
         }
-        
 
+        // pread keeps concurrent readers off the writer's stream position
         int bytesToCopy = std::min(length, static_cast<int>(node->length) - offset);
-        wad.seekg(node->offset + offset, std::ios::beg);
-        wad.read(buffer, bytesToCopy);
-        return bytesToCopy;
-        
+        int copied = 0;
+        size_t pos = offset;
+        const Extent* bad = nullptr;
+        for (const auto& extent : node->extents) {
+            if (pos >= extent.length) {
+                pos -= extent.length;
+                continue;
+            }
+            size_t chunk = std::min(extent.length - pos, static_cast<size_t>(bytesToCopy - copied));
+            ssize_t bytesRead = pread(fd, buffer + copied, chunk, extent.offset + pos);
+            if (bytesRead < 0) {
+                return -1;
+            }
+            if (verify.load(std::memory_order_relaxed) && !extent.crcs.empty() &&
+                !verifyRange(extent, pos, bytesRead, buffer + copied)) {
+                bad = &extent;
+                break;
+            }
+            copied += bytesRead;
+            pos = 0;
+            if (copied == bytesToCopy || static_cast<size_t>(bytesRead) < chunk) {
+                break;
+            }
+        }
+        if (bad == nullptr) {
+            return copied;
+        }
+        version = guard.snapshot->version;
+        damaged = bad->offset;
+    }
+
+    // an in-place write lands before its checksum is published: wait for the writer and
+    // retry against the newer version before calling it corrupt. The read guard is released
+    // first, since a writer may be waiting for old readers while holding the lock.
+    bool stale;
+    {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        stale = current.load()->version != version;
+    }
+    if (stale) {
+        return getContents(path, buffer, length, offset);
     }
+    std::cout << "Checksum mismatch in " << path << " at lump offset " << damaged << std::endl;
     return -1;
 }
 
@@ -236,14 +692,14 @@ int Wad::getDirectory(const std::string &path, std::vector<std::string> *directo
         normPath += "/";
     }
 
-    auto it = pathMap.find(normPath);
-    if (it == pathMap.end() || !it->second->isDirectory) {
+    ReadGuard guard(*this);
+    const Node* dirNode = guard.snapshot->find(normPath);
+    if (dirNode == nullptr || !dirNode->isDirectory) {
         return -1;
     }
 
-    Node* dirNode = it->second;
-    for (const Node* child : dirNode->children) {
-        directory->push_back(child->filename);
+    for (const auto& child : dirNode->children) {
+        directory->push_back(LumpName::unpack(child->name));
     }
 
     return directory->size();
@@ -296,13 +752,17 @@ void Wad::createDirectory(const std::string &path) {
 
     //std::cout << "Parent path: " << parentPath << ", Directory name: " << dirName << std::endl;
 
+    // writers are serialized; readers keep using the published snapshot meanwhile
+    std::lock_guard<std::mutex> lock(writeMutex);
+    const Snapshot* snap = current.load();
+
     // Ensure parent directory exists
-    auto it = pathMap.find(parentPath);
-    if (it == pathMap.end()) {
+    const Node* parentDir = snap->find(parentPath);
+    if (parentDir == nullptr) {
         //std::cout << "Parent directory does not exist: " << parentPath << std::endl;
         return;
     }
-    if (!it->second->isDirectory) {
+    if (!parentDir->isDirectory) {
         //std::cout << "Parent path is not a directory: " << parentPath << std::endl;
         return;
     }
@@ -313,112 +773,97 @@ void Wad::createDirectory(const std::string &path) {
         return;
     }
 
-    std::regex mapMarkerRegex(R"(/E[0-9]M[0-9]/)");
-    if (std::regex_match(parentPath, mapMarkerRegex)) {
+    if (LumpName::isMapMarker(parentDir->name) || snap->find(trimPath + "/") != nullptr) {
         return;
     }
 
-    Node* parentDir = it->second;
+    uint64_t dirKey = LumpName::pack(dirName);
 
     // Special case for the root directory
     if (parentPath == "/") {
         //std::cout << "Root directory: No '_END' descriptor needed." << std::endl;
         
         // Insert new descriptors after the root, no need to look for '_END'
-        Descriptor startDesc(dirName + "_START", 0, 0);
-        Descriptor endDesc(dirName + "_END", 0, 0);
+        Descriptor startDesc(LumpName::concat(dirKey, LumpName::START), 0, 0);
+        Descriptor endDesc(LumpName::concat(dirKey, LumpName::END), 0, 0);
 
         shiftDescriptorsForSpace(32);
 
         // Insert descriptors at the end of the list
         descriptors.push_back(startDesc);
         descriptors.push_back(endDesc);
+        shiftDescriptorIndex(descriptors.size() - 2, 2);
 
-        // Update the data structures
-        Node* newDir = new Node(dirName, 0, 0, true);
-        parentDir->children.push_back(newDir);
-        pathMap[trimPath + "/"] = newDir;
-
-        numDescriptors += 2;
-        // Write the updated descriptors to the file at the correct location
-        wad.seekp(descriptorOffset, std::ios::beg); 
-        for (const auto& desc : descriptors) {
-            wad.write(reinterpret_cast<const char*>(&desc.offset), 4);
-            wad.write(reinterpret_cast<const char*>(&desc.length), 4);
-            wad.write(desc.name.c_str(), 8);
-        }
-        if (!wad) {
-            std::cout << "Failed to write descriptors to the WAD file" << std::endl;
-        }            
-
-        wad.seekp(4);
-        wad.write(reinterpret_cast<const char*>(&numDescriptors), sizeof(numDescriptors));
+        // only the new slots change on disk
+        writeDescriptors(descriptors.size() - 2);
 
+        // Update the data structures
+        publish(trimPath + "/", std::make_shared<Node>(dirKey, 0, 0, true));
         return;
     }
 
 
 
     // Create start and end descriptors for the new directory
-    Descriptor startDesc(dirName + "_START", 0, 0);
-    Descriptor endDesc(dirName + "_END", 0, 0);
+    Descriptor startDesc(LumpName::concat(dirKey, LumpName::START), 0, 0);
+    Descriptor endDesc(LumpName::concat(dirKey, LumpName::END), 0, 0);
 
     shiftDescriptorsForSpace(32);
 
     // Find the position to insert the new descriptors
-    auto endIt = std::find_if(descriptors.begin(), descriptors.end(), [&](const Descriptor& desc) {
-        return desc.name == parentDir->filename + "_END";
-    });
+    uint64_t parentEnd = LumpName::concat(parentDir->name, LumpName::END);
+    size_t endIndex = findDescriptor(parentEnd);
 
-    if (endIt == descriptors.end()) {
+    if (endIndex == descriptors.size()) {
         std::cout << "Parent directory '_END' descriptor not found: " 
-                  << parentDir->filename + "_END" << std::endl;
+                  << LumpName::unpack(parentEnd) << std::endl;
         return;
     }
 
 
-    // Insert the new descriptors
-    auto startIt = descriptors.insert(endIt, startDesc);
-    descriptors.insert(startIt + 1, endDesc);
+    // Insert the new descriptors; each one only shifts the slots up to a nearby spare
+    size_t startIndex = insertDescriptor(endIndex, startDesc);
+    insertDescriptor(startIndex + 1, endDesc);
 
     //std::cout << "Descriptors inserted successfully" << std::endl;
 
-    // Update the data structures
-    Node* newDir = new Node(dirName, 0, 0, true);
-    parentDir->children.push_back(newDir);
-    pathMap[trimPath + "/"] = newDir;
-
-    // Increment the number of descriptors in the header
-    numDescriptors += 2;
 
     //std::cout << "Directory created successfully: " << trimPath << std::endl;
 
-    wad.seekp(descriptorOffset, std::ios::beg);
-    for (const auto& desc : descriptors) {
-        wad.write(reinterpret_cast<const char*>(&desc.offset), 4);
-        wad.write(reinterpret_cast<const char*>(&desc.length), 4);
-        wad.write(desc.name.c_str(), 8); 
-    }
-
-    if (!wad) {
-        std::cout << "Failed to write descriptors to the WAD file" << std::endl;
-    }
-
-    // Update the descriptor count in the header
-    wad.seekp(4);
-    wad.write(reinterpret_cast<const char*>(&numDescriptors), sizeof(numDescriptors));
-
     if (wad.is_open()) {
         wad.flush();
     }
-    
+
+    // Update the data structures
+    publish(trimPath + "/", std::make_shared<Node>(dirKey, 0, 0, true));
 }
 
 void Wad::shiftDescriptorsForSpace(size_t spaceNeeded) {
-    size_t numBytesToShift = spaceNeeded;
-    size_t shiftAmount = numBytesToShift / sizeof(Descriptor);
-    descriptors.resize(descriptors.size() + shiftAmount); 
-    std::copy_backward(descriptors.begin(), descriptors.end() - shiftAmount, descriptors.end());
+    // spaceNeeded is in on-disk bytes (16 per descriptor); make room in memory so
+    // the following insert does not reallocate the descriptor list
+    descriptors.reserve(descriptors.size() + spaceNeeded / 16);
+}
+
+size_t Wad::findDescriptor(uint64_t name, size_t from) const {
+// Returns the index of the first descriptor at or after from with the given packed name,
+// or descriptors.size() if there is none.
+    const Descriptor* descs = descriptors.data();
+    size_t count = descriptors.size();
+    size_t i = from;
+
+    // names are plain 64-bit keys, so test four descriptors per iteration
+    for (; i + 4 <= count; i += 4) {
+        if ((descs[i].name == name) | (descs[i + 1].name == name) |
+            (descs[i + 2].name == name) | (descs[i + 3].name == name)) {
+            break;
+        }
+    }
+    for (; i < count; ++i) {
+        if (descs[i].name == name) {
+            return i;
+        }
+    }
+    return count;
 }
 
 
@@ -441,36 +886,38 @@ void Wad::createFile(const std::string &path) {
         parentPath = parentPath + "/";
     }
 
+    std::lock_guard<std::mutex> lock(writeMutex);
+    const Snapshot* snap = current.load();
+
     // Ensure the parent directory exists
-    auto it = pathMap.find(parentPath);
-    if (it == pathMap.end() || !it->second->isDirectory) {
+    const Node* parentDir = snap->find(parentPath);
+    if (parentDir == nullptr || !parentDir->isDirectory) {
         return;
         throw std::invalid_argument("Parent directory does not exist or is not a directory");
     }
 
 
-    std::regex mapMarkerRegex(R"(E[0-9]M[0-9])");
+    if (fileName.length() > 8) {
+        return;
+    }
+
+    uint64_t fileKey = LumpName::pack(fileName);
     // Ensure the filename does not contain illegal sequences
     if (fileName.find("_START") != std::string::npos || fileName.find("_END") != std::string::npos ||
-        std::regex_search(fileName, mapMarkerRegex)) {
+        LumpName::containsMapMarker(fileKey)) {
             return;
         throw std::invalid_argument("Filename contains illegal sequences");
     }  
-    if (std::regex_search(parentPath, mapMarkerRegex)) {
-        return;
-    }
-    
-    if (fileName.length() > 8) {
+
+    if (LumpName::isMapMarker(parentDir->name) || snap->find(path) != nullptr) {
         return;
     }
-
-    Node* parentDir = it->second;
     // Special case for the root directory
     if (parentPath == "/") {
         //std::cout << "Root directory: No '_END' descriptor needed." << std::endl;
         
         // Insert new descriptors after the root, no need to look for '_END'
-        Descriptor startDesc(fileName, 0, 0);
+        Descriptor startDesc(fileKey, 0, 0);
 
         shiftDescriptorsForSpace(16);
 
@@ -478,146 +925,1007 @@ void Wad::createFile(const std::string &path) {
 
         // Insert descriptors at the end of the list
         descriptors.push_back(startDesc);
+        shiftDescriptorIndex(descriptors.size() - 1, 1);
+        indexFileDescriptor(path, descriptors.size() - 1);
 
-        // Update the data structures
-        Node* newFile = new Node(fileName, 0, 0, false);
-        parentDir->children.push_back(newFile);
-        pathMap["/" + fileName] = newFile;
-
-        numDescriptors += 1;
-        // Write the updated descriptors to the file at the correct location
-        wad.seekp(descriptorOffset, std::ios::beg); // assuming descriptorOffset is the position where descriptors start
-        for (const auto& desc : descriptors) {
-            wad.write(reinterpret_cast<const char*>(&desc.offset), 4);
-            wad.write(reinterpret_cast<const char*>(&desc.length), 4);
-            wad.write(desc.name.c_str(), 8);
-        }
-        if (!wad) {
-            std::cout << "Failed to write descriptors to the WAD file" << std::endl;
-        }            
-
-        wad.seekp(4);
-        wad.write(reinterpret_cast<const char*>(&numDescriptors), sizeof(numDescriptors));
+        // only the new slot changes on disk
+        writeDescriptors(descriptors.size() - 1);
 
+        // Update the data structures
+        publish("/" + fileName, std::make_shared<Node>(fileKey, 0, 0, false));
 
         //std::cout << "File created successfully: " << path << std::endl;
         return;
     }
 
     // Find the position to insert the new descriptor (before the parent directory's "_END" descriptor)
-    auto endIt = std::find_if(descriptors.begin(), descriptors.end(), [&](const Descriptor& desc) {
-        return desc.name == parentDir->filename + "_END";
-    });
+    size_t endIndex = findDescriptor(LumpName::concat(parentDir->name, LumpName::END));
 
-    if (endIt == descriptors.end()) {
+    if (endIndex == descriptors.size()) {
         throw std::runtime_error("Parent directory's _END descriptor not found");
     }
 
     // Create a descriptor for the new file with an initial offset and length of 0
-    Descriptor fileDesc(fileName, 0, 0);
+    Descriptor fileDesc(fileKey, 0, 0);
 
     // Shift the rest of the descriptor list 
     shiftDescriptorsForSpace(16);
 
     // Insert the new descriptor before the "_END" descriptor
-    descriptors.insert(endIt, fileDesc);
-
-    // Update the data structures
-    Node* newFile = new Node(fileName, 0, 0, false);
-    parentDir->children.push_back(newFile);
-    pathMap[path] = newFile;
+    size_t fileIndex = insertDescriptor(endIndex, fileDesc);
+    indexFileDescriptor(path, fileIndex);
 
-    // Increment the number of descriptors in the header
-    numDescriptors += 1;
     //std::cout << "File created successfully: " << path << std::endl;
 
-    wad.seekp(descriptorOffset, std::ios::beg);
-    for ( auto& desc : descriptors) {
-        wad.write(reinterpret_cast<const char*>(&desc.offset), 4);
-        wad.write(reinterpret_cast<const char*>(&desc.length), 4);
-        wad.write(desc.name.c_str(), 8); // Ensure fixed-size writes
-    }
-
-    if (!wad) {
-        std::cout << "Failed to write descriptors to the WAD file" << std::endl;
-    }
-
-    // Update the descriptor count in the header
-    wad.seekp(4);
-    wad.write(reinterpret_cast<const char*>(&numDescriptors), sizeof(numDescriptors));
-
     if (wad.is_open()) {
         wad.flush();
     }
 
+    // Update the data structures
+    publish(path, std::make_shared<Node>(fileKey, 0, 0, false));
 }
 
 int Wad::writeToFile(const std::string &path, const char *buffer, int length, int offset) {
+// Writes length bytes at offset. Bytes inside the file are overwritten in place; bytes past
+// its end are appended as a new extent (or grow the last one), so appends cost O(length).
+// Returns the amount of bytes written, or -1 if path is a directory/invalid.
     
+    std::lock_guard<std::mutex> lock(writeMutex);
+    const Snapshot* snap = current.load();
+
     // Find the node at path
-    auto it = pathMap.find(path);
-    if (it == pathMap.end()) {
+    const Node* node = snap->find(path);
+    if (node == nullptr) {
         return -1; 
     }
 
-    Node* node = it->second;
     if (node->isDirectory) {
         return -1; 
     }
 
-    if (node->length > 0) {
-        return 0;
+    if (offset < 0 || length < 0 || static_cast<size_t>(offset) > node->length) {
+        return -1;
     }
 
-    if (offset < 0 || offset > node->length) {
+    if (!wad.is_open()) {
         return -1;
     }
 
-    if (!wad.is_open()) {
+    if (length == 0) {
+        return 0;
+    }
+
+    size_t fileIndex = findFileDescriptor(path);
+    if (fileIndex == descriptors.size()) {
         return -1;
     }
-    //wad.seekg(0, std::ios::end);
-    //std::streamsize size = wad.tellg();
 
+    // readers keep seeing the old node until the new one is published
+    auto updated = std::make_shared<Node>(*node);
+    size_t end = offset + length;
+    size_t overlap = std::min(end, node->length) - offset;
+
+    // copy-on-write: bytes another descriptor still references are never modified in place
+    bool touchesShared = false;
+    size_t pos = 0;
+    for (const auto& extent : node->extents) {
+        if (pos < static_cast<size_t>(offset) + overlap && pos + extent.length > static_cast<size_t>(offset) &&
+            isSharedLump(extent.offset)) {
+            touchesShared = true;
+        }
+        pos += extent.length;
+    }
+
+    if (overlap > 0 && touchesShared) {
+        std::string data;
+        if (!readExtents(*node, data)) {
+            return -1;
+        }
+        data.resize(std::max(end, node->length));
+        std::memcpy(&data[offset], buffer, length);
+        replaceExtents(*updated, fileIndex, data);
+    }
+    else {
+        if (overlap > 0) {
+            writeInPlace(*updated, offset, buffer, overlap);
+        }
+        if (static_cast<size_t>(length) > overlap) {
+            appendToFile(*updated, fileIndex, buffer + overlap, length - overlap);
+        }
+    }
+
+    if (wad.is_open()) {
+        wad.flush();
+    }
+
+    // lump bytes are on disk before any reader can find them
+    publish(path, updated);
+
+    return length;
+    
+}
+
+size_t Wad::findFileDescriptor(const std::string &path) const {
+// Returns the index of the descriptor holding the first extent of the file at path, or
+// descriptors.size() if there is none.
+    auto it = descriptorIndex.find(path);
+    return it == descriptorIndex.end() ? descriptors.size() : it->second;
+}
+
+void Wad::linkDescriptorIndex() {
+// Points each descriptor slot at the index entry of the file starting there, after
+// buildSnapshot refilled descriptorIndex.
+    descriptorSlots.assign(descriptors.size(), nullptr);
+    for (auto& [path, index] : descriptorIndex) {
+        descriptorSlots[index] = &index;
+    }
+}
+
+void Wad::shiftDescriptorIndex(size_t at, std::ptrdiff_t delta, size_t to) {
+// Follows delta descriptors inserted at at (or -delta erased from at) by renumbering
+// the index entries of every file that starts after them, up to slot to.
+    if (delta > 0) {
+        descriptorSlots.insert(descriptorSlots.begin() + at, delta, nullptr);
+    }
+    else if (delta < 0) {
+        descriptorSlots.erase(descriptorSlots.begin() + at, descriptorSlots.begin() + at - delta);
+    }
+    for (size_t i = at; i < std::min(to, descriptorSlots.size()); ++i) {
+        if (descriptorSlots[i] != nullptr) {
+            *descriptorSlots[i] = i;
+        }
+    }
+}
+
+void Wad::indexFileDescriptor(const std::string &path, size_t index) {
+    size_t& entry = descriptorIndex[path];
+    entry = index;
+    descriptorSlots[index] = &entry;
+}
+
+size_t Wad::insertDescriptor(size_t at, const Descriptor &desc, size_t floor) {
+// Inserts desc right before the descriptor at at and writes the slots that changed. The
+// descriptors between at and the nearest spare (after at, or from floor up to at) move one
+// slot towards it, so order is kept and only that run is rewritten. Without a spare close
+// by, the tail of the table is shifted once and a run of spares is left behind desc for
+// the inserts that follow. Returns the index desc ended up at.
+    const size_t WINDOW = 256;
+    size_t spare = descriptors.size();
+    for (size_t d = 0; d < WINDOW && spare == descriptors.size(); ++d) {
+        if (at + d < descriptors.size() && descriptors[at + d].isSpare()) {
+            spare = at + d;
+        }
+        else if (d < at && at - d - 1 >= floor && descriptors[at - d - 1].isSpare()) {
+            spare = at - d - 1;
+        }
+    }
+
+    if (spare >= at && spare < descriptors.size()) {
+        std::rotate(descriptors.begin() + at, descriptors.begin() + spare, descriptors.begin() + spare + 1);
+        std::rotate(descriptorSlots.begin() + at, descriptorSlots.begin() + spare, descriptorSlots.begin() + spare + 1);
+        descriptors[at] = desc;
+        shiftDescriptorIndex(at, 0, spare + 1);
+        writeDescriptors(at, spare + 1);
+        return at;
+    }
+    if (spare < at) {
+        std::rotate(descriptors.begin() + spare, descriptors.begin() + spare + 1, descriptors.begin() + at);
+        std::rotate(descriptorSlots.begin() + spare, descriptorSlots.begin() + spare + 1, descriptorSlots.begin() + at);
+        descriptors[at - 1] = desc;
+        shiftDescriptorIndex(spare, 0, at);
+        writeDescriptors(spare, at);
+        return at - 1;
+    }
 
-    //std::cout << "Initial file size: " << size << std::endl;
+    // shifting the tail costs O(n), so leave enough spares to spread it over many inserts
+    size_t spares = std::min<size_t>(std::max<size_t>((descriptors.size() - at) / 32, 16), 1024);
+    descriptors.insert(descriptors.begin() + at, spares + 1, Descriptor());
+    descriptors[at] = desc;
+    shiftDescriptorIndex(at, spares + 1);
+    writeDescriptors(at);
+    return at;
+}
 
-    int lumpData = descriptorOffset;
-    node->length = length;
-    node->offset = descriptorOffset;
-    //std::cout << "New node offset: " << node->offset << " and length: " << node->length << std::endl;
+void Wad::writeDescriptors(size_t from, size_t to) {
+// Writes descriptor slots [from, to) (to the end by default) and the header.
+    to = std::min(to, descriptors.size());
+    from = std::min(from, to);
+
+    std::vector<char> table((to - from) * 16);
+    char* slot = table.data();
+    for (size_t i = from; i < to; ++i) {
+        const auto& desc = descriptors[i];
+        std::memcpy(slot, &desc.offset, 4);
+        std::memcpy(slot + 4, &desc.length, 4);
+        std::memcpy(slot + 8, &desc.name, 8);
+        slot += 16;
+    }
+    wad.seekp(descriptorOffset + from * 16, std::ios::beg);
+    wad.write(table.data(), table.size());
 
+    numDescriptors = descriptors.size();
+    wad.seekp(4, std::ios::beg);
+    wad.write(reinterpret_cast<const char*>(&numDescriptors), sizeof(numDescriptors));
+    wad.write(reinterpret_cast<const char*>(&descriptorOffset), sizeof(descriptorOffset));
 
-    for (auto& desc : descriptors) {
-        if (desc.name == node->filename) {
-            desc.length = node->length;
-            desc.offset = node->offset;
-            //std::cout << "descriptor node updated" << std::endl;
+    if (!wad) {
+        std::cout << "Failed to write descriptors to the WAD file" << std::endl;
+    }
+}
+
+void Wad::writeDescriptor(size_t index) {
+    const auto& desc = descriptors[index];
+    wad.seekp(descriptorOffset + index * 16, std::ios::beg);
+    wad.write(reinterpret_cast<const char*>(&desc.offset), 4);
+    wad.write(reinterpret_cast<const char*>(&desc.length), 4);
+    wad.write(reinterpret_cast<const char*>(&desc.name), 8);
+}
+
+size_t Wad::allocateLump(size_t length) {
+// Returns where length new lump bytes go. They fill the headroom between the end of the
+// lump data and the descriptor table; only when it runs out does the table move, leaving
+// fresh headroom behind the new bytes so later appends do not move it again.
+    size_t lumpData = dataEnd;
+    if (dataEnd + length > static_cast<size_t>(descriptorOffset)) {
+        // the new bytes may cover the live table, so the table is copied past both it and
+        // them, and the header pointed at the copy, before the caller writes anything
+        size_t tableEnd = descriptorOffset + numDescriptors * 16;
+        size_t headroom = reserve == 0 ? 0 : std::max(reserve, (dataEnd + length) / 8);
+        descriptorOffset = std::max(dataEnd + length, tableEnd) + headroom;
+        writeDescriptors();
+        wad.flush();
+    }
+    dataEnd += length;
+    return lumpData;
+}
+
+void Wad::setReserve(size_t bytes) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    reserve = bytes;
+}
+
+bool Wad::readExtents(const Node &node, std::string &data) {
+    data.clear();
+    std::string chunk;
+    for (const auto& extent : node.extents) {
+        if (!readLump(extent.offset, extent.length, chunk)) {
+            return false;
+        }
+        data += chunk;
+    }
+    return true;
+}
+
+void Wad::writeInPlace(Node &node, size_t offset, const char *data, size_t length) {
+    // overwrite existing bytes extent by extent; nothing in the table changes
+    size_t pos = offset;
+    std::string block;
+    for (auto& extent : node.extents) {
+        if (length == 0) {
+            break;
+        }
+        if (pos >= extent.length) {
+            pos -= extent.length;
+            continue;
+        }
+        size_t chunk = std::min(extent.length - pos, length);
+        wad.seekp(extent.offset + pos, std::ios::beg);
+        wad.write(data, chunk);
+        // only the touched blocks are rehashed; a block the write covers partly is read back
+        for (size_t k = pos / CRC_BLOCK; !extent.crcs.empty() && k * CRC_BLOCK < pos + chunk; ++k) {
+            size_t start = k * CRC_BLOCK;
+            size_t blockLength = extent.blockLength(k);
+            if (start >= pos && start + blockLength <= pos + chunk) {
+                recordChecksum(extent, k, crc32c(data + (start - pos), blockLength));
+            }
+            else if (readLump(extent.offset + start, blockLength, block)) {
+                recordChecksum(extent, k, crc32c(block.data(), blockLength));
+            }
+            else {
+                extent.crcs.clear();
+            }
         }
+        data += chunk;
+        length -= chunk;
+        pos = 0;
     }
+}
 
-    wad.seekp(descriptorOffset + length, std::ios::beg);
-    for (auto& desc : descriptors) {   
-        wad.write(reinterpret_cast<const char*>(&desc.offset), 4);
-        wad.write(reinterpret_cast<const char*>(&desc.length), 4);
-        wad.write(desc.name.c_str(), 8);
+void Wad::appendToFile(Node &node, size_t fileIndex, const char *data, size_t length) {
+    // lump bytes are written before the descriptors that point at them
+    size_t lumpData = allocateLump(length);
+    wad.seekp(lumpData, std::ios::beg);
+    wad.write(data, length);
+
+    if (node.extents.empty()) {
+        node.extents.push_back({lumpData, length});
+        node.extents.back().crcs = checksumBlocks(lumpData, data, length);
+        descriptors[fileIndex].offset = lumpData;
+        descriptors[fileIndex].length = length;
+        lumpRefs[lumpData]++;
+        writeDescriptor(fileIndex);
+    }
+    else if (node.extents.back().offset + node.extents.back().length == lumpData &&
+             !isSharedLump(node.extents.back().offset)) {
+        // the file was the last thing written: grow its last extent
+        size_t last = fileIndex + node.extents.size() - 1;
+        Extent& extent = node.extents.back();
+        size_t oldLength = extent.length;
+        extent.length += length;
+        if (!extent.crcs.empty()) {
+            // the last block's checksum is extended; further blocks hash only the new bytes
+            size_t fill = 0;
+            if (oldLength % CRC_BLOCK != 0) {
+                size_t k = extent.crcs.size() - 1;
+                fill = std::min(CRC_BLOCK - oldLength % CRC_BLOCK, length);
+                recordChecksum(extent, k, crc32c(data, fill, extent.crcs[k]));
+            }
+            auto added = checksumBlocks(extent.offset + oldLength + fill, data + fill, length - fill);
+            extent.crcs.insert(extent.crcs.end(), added.begin(), added.end());
+        }
+        descriptors[last].length += length;
+        writeDescriptor(last);
+    }
+    else {
+        size_t slot = fileIndex + node.extents.size();
+        node.extents.push_back({lumpData, length});
+        node.extents.back().crcs = checksumBlocks(lumpData, data, length);
+        // continuations follow the file's descriptor, so the new one only moves later slots
+        insertDescriptor(slot, Descriptor(0, lumpData, length), slot);
+        lumpRefs[lumpData]++;
     }
+    node.length += length;
+}
+
+void Wad::replaceExtents(Node &node, size_t fileIndex, const std::string &data) {
+    // write data as one fresh lump and drop the file's old extents and continuation descriptors
+    size_t lumpData = allocateLump(data.size());
     wad.seekp(lumpData, std::ios::beg);
-    wad.write(buffer, length);
+    wad.write(data.data(), data.size());
 
-    descriptorOffset += length;    
+    repointFile(node, fileIndex, lumpData, data.size());
+    if (!data.empty()) {
+        node.extents.back().crcs = checksumBlocks(lumpData, data.data(), data.size());
+    }
+}
 
-    // Update the header 
-    wad.seekp(8, std::ios::beg);
-    wad.write(reinterpret_cast<char*>(&descriptorOffset), sizeof(descriptorOffset));
-    pathMap[path] = node;    
+void Wad::repointFile(Node &node, size_t fileIndex, size_t offset, size_t length) {
+    // make the file one extent of length bytes at offset, releasing its old extents
+    for (const auto& extent : node.extents) {
+        if (--lumpRefs[extent.offset] <= 0) {
+            lumpRefs.erase(extent.offset);
+        }
+    }
+    // the continuation descriptors become spares rather than shifting the rest of the table
+    size_t last = fileIndex + std::max<size_t>(node.extents.size(), 1);
+    for (size_t i = fileIndex + 1; i < last; ++i) {
+        descriptors[i] = Descriptor();
+    }
 
+    descriptors[fileIndex].offset = length == 0 ? 0 : offset;
+    descriptors[fileIndex].length = length;
+    node.extents.clear();
+    if (length > 0) {
+        node.extents.push_back({offset, length});
+        lumpRefs[offset]++;
+    }
+    node.length = length;
+
+    writeDescriptors(fileIndex, last);
+}
+
+int Wad::mergeExtents() {
+// Rewrites every multi-extent lump as one contiguous classic lump and removes the
+// continuation descriptors, so the archive is readable by tools that know nothing of
+// extents. A lump whose extents cannot all be read is left as it is. Returns the amount
+// of lumps merged, or -1 if any lump was left unmerged (the others are still merged).
+    std::lock_guard<std::mutex> lock(writeMutex);
+
+    std::vector<Descriptor> merged;
+    merged.reserve(descriptors.size());
+    int count = 0;
+    bool failed = false;
+    std::string data;
+    std::string chunk;
+
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        if (descriptors[i].isSpare()) {
+            // other WAD tools would list spares as nameless lumps
+            continue;
+        }
+        size_t last = i;
+        while (last + 1 < descriptors.size() && descriptors[last + 1].name == 0 && descriptors[last + 1].length > 0) {
+            ++last;
+        }
+        if (last == i || descriptors[i].name == 0) {
+            merged.push_back(descriptors[i]);
+            continue;
+        }
+
+        // a lump that cannot be read in full keeps its extents rather than losing bytes
+        data.clear();
+        bool complete = true;
+        for (size_t j = i; j <= last && complete; ++j) {
+            if (descriptors[j].length > 0) {
+                complete = readLump(descriptors[j].offset, descriptors[j].length, chunk);
+                data += chunk;
+            }
+        }
+        if (!complete) {
+            std::cout << "Could not read " << LumpName::unpack(descriptors[i].name) << ", left unmerged" << std::endl;
+            merged.insert(merged.end(), descriptors.begin() + i, descriptors.begin() + last + 1);
+            failed = true;
+            i = last;
+            continue;
+        }
+        for (size_t j = i; j <= last; ++j) {
+            if (descriptors[j].length > 0 && --lumpRefs[descriptors[j].offset] <= 0) {
+                lumpRefs.erase(descriptors[j].offset);
+            }
+        }
+
+        size_t lumpData = allocateLump(data.size());
+        wad.seekp(lumpData, std::ios::beg);
+        wad.write(data.data(), data.size());
+        merged.push_back(Descriptor(descriptors[i].name, lumpData, data.size()));
+        checksumBlocks(lumpData, data.data(), data.size());
+        lumpRefs[lumpData]++;
+        count++;
+        i = last;
+    }
+
+    if (count == 0 && merged.size() == descriptors.size()) {
+        return failed ? -1 : 0;
+    }
+
+    descriptors.swap(merged);
+    writeDescriptors(0);
     if (wad.is_open()) {
         wad.flush();
     }
+    install(buildSnapshot(&descriptorIndex));
+    linkDescriptorIndex();
+    return failed ? -1 : count;
+}
 
-    return length;
-    
+
+bool Wad::readLump(size_t offset, size_t length, std::string &data) {
+    data.resize(length);
+    wad.clear();
+    wad.seekg(offset, std::ios::beg);
+    wad.read(&data[0], length);
+    bool complete = static_cast<size_t>(wad.gcount()) == length;
+    wad.clear();
+    return complete;
+}
+
+void Wad::buildLumpIndex() {
+    // hash every distinct lump currently in the file
+    lumpIndex.clear();
+    std::map<size_t, bool> hashed;
+    std::string data;
+    for (const auto& desc : descriptors) {
+        if (desc.length == 0 || hashed[desc.offset]) {
+            continue;
+        }
+        hashed[desc.offset] = true;
+        if (readLump(desc.offset, desc.length, data)) {
+            lumpIndex[hashLump(data.data(), data.size())].push_back(desc.offset);
+        }
+    }
+}
+
+bool Wad::findDuplicateLump(const char *buffer, size_t length, uint64_t hash, size_t &offset) {
+    // a hash hit is only trusted once the stored bytes compare equal
+    auto it = lumpIndex.find(hash);
+    if (it == lumpIndex.end()) {
+        return false;
+    }
+
+    std::string data;
+    for (size_t candidate : it->second) {
+        if (readLump(candidate, length, data) && std::memcmp(data.data(), buffer, length) == 0) {
+            offset = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+int Wad::dedupFile(const std::string &path) {
+// Aliases the file at path to an existing lump with identical content and releases its own
+// extents. Single writes are never aliased, since FUSE hands a lump over in 4 KiB pieces and
+// a first piece can match an unrelated small lump; this runs once the file is complete
+// (wadfs calls it when a file opened for writing is closed).
+// Returns 1 if the file now aliases another lump, 0 if not, -1 if path is not a file.
+    std::lock_guard<std::mutex> lock(writeMutex);
+    const Snapshot* snap = current.load();
+    const Node* node = snap->find(path);
+    if (node == nullptr || node->isDirectory) {
+        return -1;
+    }
+    if (!dedup || node->length == 0 || (node->extents.size() == 1 && isSharedLump(node->extents[0].offset))) {
+        return 0;
+    }
+
+    std::string data;
+    if (!readExtents(*node, data)) {
+        return -1;
+    }
+    uint64_t hash = hashLump(data.data(), data.size());
+    size_t lumpData = 0;
+    if (!findDuplicateLump(data.data(), data.size(), hash, lumpData)) {
+        // later copies of a contiguous file can alias it
+        if (node->extents.size() == 1) {
+            lumpIndex[hash].push_back(node->extents[0].offset);
+        }
+        return 0;
+    }
+    if (node->extents.size() == 1 && lumpData == node->extents[0].offset) {
+        return 0;
+    }
+
+    size_t fileIndex = findFileDescriptor(path);
+    if (fileIndex == descriptors.size()) {
+        return -1;
+    }
+    auto updated = std::make_shared<Node>(*node);
+    repointFile(*updated, fileIndex, lumpData, data.size());
+    updated->extents.back().crcs = checksumBlocks(lumpData, data.data(), data.size());
+    if (wad.is_open()) {
+        wad.flush();
+    }
+    std::vector<Extent> released = node->extents;
+    publish(path, updated);
+
+    // the copy was appended while the file was written; give its space back
+    releaseTail(std::move(released));
+    return 1;
+}
+
+void Wad::releaseTail(std::vector<Extent> released) {
+// Moves dataEnd back over those of the released extents that end the lump data and are no
+// longer referenced, so the next append reuses the space. Readers of older versions are
+// waited out first, since they may still read those bytes. The table then moves down behind
+// the new headroom and the file is shortened, unless the copy would overlap the live table.
+    std::sort(released.begin(), released.end(), [](const Extent& a, const Extent& b) {
+        return a.offset > b.offset;
+    });
+    size_t end = dataEnd;
+    for (const auto& extent : released) {
+        if (extent.offset + extent.length == end && lumpRefs.count(extent.offset) == 0) {
+            end = extent.offset;
+        }
+    }
+    if (end == dataEnd) {
+        return;
+    }
+
+    while (!retired.empty()) {
+        reclaim();
+        if (!retired.empty()) {
+            std::this_thread::yield();
+        }
+    }
+
+    for (auto& [hash, offsets] : lumpIndex) {
+        offsets.erase(std::remove_if(offsets.begin(), offsets.end(), [&](size_t offset) {
+            return offset >= end;
+        }), offsets.end());
+    }
+    for (const auto& extent : released) {
+        for (size_t k = 0; extent.offset >= end && k < extent.blocks(); ++k) {
+            checksums.erase(extent.offset + k * CRC_BLOCK);
+        }
+    }
+    dataEnd = end;
+
+    size_t headroom = reserve == 0 ? 0 : std::max(reserve, dataEnd / 8);
+    size_t tableOffset = dataEnd + headroom;
+    size_t tableEnd = tableOffset + descriptors.size() * 16;
+    if (tableEnd <= static_cast<size_t>(descriptorOffset)) {
+        // the header points at the new copy before the old table is cut off
+        descriptorOffset = tableOffset;
+        writeDescriptors();
+        wad.flush();
+        if (truncate(wadPath.c_str(), tableEnd) != 0) {
+            std::cout << "Failed to shorten " << wadPath << std::endl;
+        }
+    }
+}
+
+void Wad::setDedup(bool enabled) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    dedup = enabled;
+    if (dedup) {
+        buildLumpIndex();
+    }
+    else {
+        lumpIndex.clear();
+    }
+}
+
+bool Wad::isSharedLump(size_t offset) const {
+// A lump referenced by more than one descriptor must never be modified in place;
+// writers have to copy it out to a fresh offset first.
+    auto it = lumpRefs.find(offset);
+    return it != lumpRefs.end() && it->second > 1;
+}
+
+DedupStats Wad::getDedupStats() {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    DedupStats stats;
+    std::unordered_map<uint64_t, std::vector<size_t>> contents;
+    std::map<size_t, size_t> seenOffsets;
+    std::string data;
+    std::string other;
+
+    for (const auto& desc : descriptors) {
+        if (desc.length == 0) {
+            continue;
+        }
+        stats.lumps++;
+        stats.totalBytes += desc.length;
+
+        // descriptors that already point at the same offset cost nothing extra
+        if (seenOffsets.count(desc.offset)) {
+            stats.sharedLumps++;
+            continue;
+        }
+        seenOffsets[desc.offset] = desc.length;
+        stats.storedBytes += desc.length;
+
+        if (!readLump(desc.offset, desc.length, data)) {
+            stats.uniqueLumps++;
+            continue;
+        }
+
+        bool duplicate = false;
+        auto& candidates = contents[hashLump(data.data(), data.size())];
+        for (size_t candidate : candidates) {
+            if (seenOffsets[candidate] == desc.length && readLump(candidate, desc.length, other) && other == data) {
+                duplicate = true;
+                break;
+            }
+        }
+
+        if (duplicate) {
+            stats.duplicateBytes += desc.length;
+        }
+        else {
+            candidates.push_back(desc.offset);
+            stats.uniqueLumps++;
+        }
+    }
+    // what is left of the lump area: copies released without being reclaimed, old tables
+    stats.unreferencedBytes = dataEnd - 12 - std::min(dataEnd - 12, stats.storedBytes);
+    return stats;
+}
+
+void Wad::printDedupReport() {
+    DedupStats stats = getDedupStats();
+    std::cout << "Lumps with data:     " << stats.lumps << "\n"
+              << "Unique contents:     " << stats.uniqueLumps << "\n"
+              << "Already aliased:     " << stats.sharedLumps << "\n"
+              << "Referenced bytes:    " << stats.totalBytes << "\n"
+              << "Stored bytes:        " << stats.storedBytes << "\n"
+              << "Reclaimable bytes:   " << stats.duplicateBytes << "\n"
+              << "Unreferenced bytes:  " << stats.unreferencedBytes << std::endl;
+}
+
+void Wad::loadChecksums() {
+    checksums.clear();
+    crcRecords = readChecksums(checksums);
+}
+
+size_t Wad::readChecksums(std::unordered_map<size_t, Checksum> &into) const {
+// Replays the sidecar into the map and returns the amount of records read. Records are 20
+// bytes (offset, length, crc); a torn last record from an interrupted write is ignored and
+// cut off before the next append.
+    size_t records = 0;
+    std::ifstream sidecar(crcPath, std::ios::binary);
+    char header[4];
+    if (!sidecar.read(header, 4) || std::memcmp(header, "WCRC", 4) != 0) {
+        return 0;
+    }
+    char record[20];
+    while (sidecar.read(record, 20)) {
+        uint64_t offset;
+        uint64_t length;
+        uint32_t crc;
+        std::memcpy(&offset, record, 8);
+        std::memcpy(&length, record + 8, 8);
+        std::memcpy(&crc, record + 16, 4);
+        into[offset] = {length, crc};
+        records++;
+    }
+    return records;
+}
+
+std::vector<uint32_t> Wad::checksumBlocks(size_t offset, const char *data, size_t length) {
+// Checksums length bytes written at offset block by block and logs every block.
+    std::vector<uint32_t> crcs;
+    for (size_t start = 0; start < length; start += CRC_BLOCK) {
+        size_t blockLength = std::min(CRC_BLOCK, length - start);
+        crcs.push_back(crc32c(data + start, blockLength));
+        appendChecksum(offset + start, blockLength, crcs.back());
+    }
+    return crcs;
+}
+
+void Wad::recordChecksum(Extent &extent, size_t block, uint32_t crc) {
+    extent.crcs[block] = crc;
+    appendChecksum(extent.offset + block * CRC_BLOCK, extent.blockLength(block), crc);
+}
+
+void Wad::appendChecksum(size_t offset, size_t length, uint32_t crc) {
+    checksums[offset] = {length, crc};
+    if (!exclusive) {
+        return;
+    }
+
+    if (crcFd < 0) {
+        crcFd = open(crcPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        struct stat st;
+        if (crcFd < 0 || fstat(crcFd, &st) != 0) {
+            std::cout << "Failed to open checksum sidecar " << crcPath << std::endl;
+            return;
+        }
+        if (st.st_size < 4) {
+            if (ftruncate(crcFd, 0) != 0 || write(crcFd, "WCRC", 4) != 4) {
+                std::cout << "Failed to write checksum sidecar " << crcPath << std::endl;
+            }
+        }
+        else if ((st.st_size - 4) % 20 != 0 && ftruncate(crcFd, st.st_size - (st.st_size - 4) % 20) != 0) {
+            std::cout << "Failed to repair checksum sidecar " << crcPath << std::endl;
+        }
+    }
+
+    char record[20];
+    uint64_t offset64 = offset;
+    uint64_t length64 = length;
+    std::memcpy(record, &offset64, 8);
+    std::memcpy(record + 8, &length64, 8);
+    std::memcpy(record + 16, &crc, 4);
+    if (write(crcFd, record, 20) != 20) {
+        std::cout << "Failed to write checksum sidecar " << crcPath << std::endl;
+    }
+    crcRecords++;
+}
+
+void Wad::compactChecksums() {
+// Rewrites the sidecar with one record per block of a live extent, replacing it atomically.
+// Only called once the descriptor table matches the checksums just logged.
+    std::unordered_map<size_t, size_t> live;
+    for (const auto& desc : descriptors) {
+        for (size_t start = 0; start < desc.length; start += CRC_BLOCK) {
+            live[desc.offset + start] = std::min(CRC_BLOCK, desc.length - start);
+        }
+    }
+    for (auto it = checksums.begin(); it != checksums.end();) {
+        auto block = live.find(it->first);
+        it = block != live.end() && block->second == it->second.length ? std::next(it) : checksums.erase(it);
+    }
+
+    std::string tmpPath = crcPath + ".tmp";
+    std::ofstream sidecar(tmpPath, std::ios::binary | std::ios::trunc);
+    sidecar.write("WCRC", 4);
+    for (const auto& [offset, checksum] : checksums) {
+        uint64_t offset64 = offset;
+        uint64_t length64 = checksum.length;
+        sidecar.write(reinterpret_cast<const char*>(&offset64), 8);
+        sidecar.write(reinterpret_cast<const char*>(&length64), 8);
+        sidecar.write(reinterpret_cast<const char*>(&checksum.crc), 4);
+    }
+    sidecar.close();
+    if (!sidecar || rename(tmpPath.c_str(), crcPath.c_str()) != 0) {
+        std::cout << "Failed to compact checksum sidecar " << crcPath << std::endl;
+        return;
+    }
+
+    if (crcFd >= 0) {
+        close(crcFd);
+    }
+    crcFd = open(crcPath.c_str(), O_WRONLY | O_APPEND);
+    crcRecords = checksums.size();
+}
+
+bool Wad::verifyRange(const Extent &extent, size_t pos, size_t length, const char *data) const {
+// Checks the blocks of extent overlapping bytes [pos, pos + length), which data holds. A block
+// the range covers only partly is read again whole, so a read costs at most two extra blocks.
+    std::string block;
+    for (size_t k = pos / CRC_BLOCK; length > 0 && k * CRC_BLOCK < pos + length; ++k) {
+        size_t start = k * CRC_BLOCK;
+        size_t blockLength = extent.blockLength(k);
+        const char *bytes;
+        if (start >= pos && start + blockLength <= pos + length) {
+            bytes = data + (start - pos);
+        }
+        else {
+            block.resize(blockLength);
+            if (pread(fd, &block[0], blockLength, extent.offset + start) != static_cast<ssize_t>(blockLength)) {
+                return false;
+            }
+            bytes = block.data();
+        }
+        if (crc32c(bytes, blockLength) != extent.crcs[k]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Wad::setVerify(bool enabled) {
+    verify.store(enabled);
+}
+
+ScrubReport Wad::scrub(unsigned threads) {
+// Checks every block of lump data against its recorded CRC32C. Blocks are read in offset
+// order, neighbours batched into one large pread, by a pool of threads pulling the next
+// batch, so the disk sees mostly sequential reads. Blocks without a checksum get one recorded.
+// Writers are only held off while the extent list is copied and the results are applied.
+// Without the WAD's lock the scrub is read-only: nothing is recorded, and since the owner may
+// have rewritten blocks since this instance loaded, a mismatch is checked again against the
+// owner's latest sidecar before it is reported.
+    auto started = std::chrono::steady_clock::now();
+    ScrubReport report;
+
+    struct Job {
+        size_t offset;
+        size_t length;
+        bool hasChecksum;
+        uint32_t expected;
+        uint32_t actual;
+        bool readable;
+    };
+    std::vector<Job> jobs;
+    {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        for (const auto& desc : descriptors) {
+            for (size_t start = 0; start < desc.length; start += CRC_BLOCK) {
+                size_t offset = desc.offset + start;
+                size_t length = std::min(CRC_BLOCK, desc.length - start);
+                auto it = checksums.find(offset);
+                bool known = it != checksums.end() && it->second.length == length;
+                jobs.push_back({offset, length, known, known ? it->second.crc : 0, 0, false});
+            }
+        }
+    }
+    std::sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) {
+        return a.offset != b.offset ? a.offset < b.offset : a.length < b.length;
+    });
+    // aliased (deduplicated) lumps are only read once
+    jobs.erase(std::unique(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) {
+        return a.offset == b.offset && a.length == b.length;
+    }), jobs.end());
+
+    // a batch is a run of blocks read with one pread
+    const size_t BATCH = 4 << 20;
+    const size_t GAP = 64 << 10;
+    std::vector<std::pair<size_t, size_t>> batches;
+    for (size_t i = 0; i < jobs.size();) {
+        size_t last = i + 1;
+        size_t end = jobs[i].offset + jobs[i].length;
+        while (last < jobs.size() && jobs[last].offset >= end && jobs[last].offset - end <= GAP &&
+               jobs[last].offset + jobs[last].length - jobs[i].offset <= BATCH) {
+            end = jobs[last].offset + jobs[last].length;
+            ++last;
+        }
+        batches.push_back({i, last});
+        i = last;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<size_t>(threads, std::max<size_t>(1, batches.size()));
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        std::vector<char> buffer(BATCH);
+        for (size_t b = next++; b < batches.size(); b = next++) {
+            auto [first, last] = batches[b];
+            const Job& head = jobs[first];
+            size_t span = jobs[last - 1].offset + jobs[last - 1].length - head.offset;
+            ssize_t got = pread(fd, buffer.data(), span, head.offset);
+            for (size_t j = first; j < last; ++j) {
+                size_t start = jobs[j].offset - head.offset;
+                jobs[j].readable = got >= 0 && start + jobs[j].length <= static_cast<size_t>(got);
+                if (jobs[j].readable) {
+                    jobs[j].actual = crc32c(buffer.data() + start, jobs[j].length);
+                }
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    std::lock_guard<std::mutex> lock(writeMutex);
+    // live extents by offset, to find the extent each block belongs to now
+    std::map<size_t, size_t> extents;
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        if (descriptors[i].length > 0) {
+            extents.emplace(descriptors[i].offset, i);
+        }
+    }
+    std::string data;
+    // the owning process's checksums, read on the first mismatch of a read-only scrub
+    std::unordered_map<size_t, Checksum> owner;
+    bool ownerLoaded = false;
+    for (const auto& job : jobs) {
+        report.blocks++;
+        report.bytes += job.length;
+        auto extent = extents.upper_bound(job.offset);
+        if (extent == extents.begin()) {
+            continue;
+        }
+        --extent;
+        const Descriptor& desc = descriptors[extent->second];
+        size_t start = job.offset - desc.offset;
+        auto it = checksums.find(job.offset);
+        bool known = it != checksums.end() && it->second.length == job.length;
+        if (start >= desc.length || start % CRC_BLOCK != 0 || std::min(CRC_BLOCK, desc.length - start) != job.length ||
+            (job.hasChecksum && !known)) {
+            // rewritten or dropped since the list was copied
+            continue;
+        }
+        if (!known && job.readable) {
+            if (!exclusive) {
+                report.unchecked++;
+                continue;
+            }
+            // a writer recording its own checksum meanwhile wins over what was read here
+            appendChecksum(job.offset, job.length, job.actual);
+            report.recorded++;
+            continue;
+        }
+        if (job.readable && known && job.actual == it->second.crc) {
+            report.verified++;
+            continue;
+        }
+        if (!exclusive && known) {
+            if (!ownerLoaded) {
+                readChecksums(owner);
+                ownerLoaded = true;
+            }
+            auto latest = owner.find(job.offset);
+            struct stat st;
+            if (latest == owner.end() || latest->second.length != job.length ||
+                (fstat(fd, &st) == 0 && job.offset + job.length > static_cast<size_t>(st.st_size))) {
+                // the owner has reused this block for a different extent, or given it back, since
+                report.unchecked++;
+                continue;
+            }
+            if (readLump(job.offset, job.length, data) && crc32c(data.data(), data.size()) == latest->second.crc) {
+                report.verified++;
+                continue;
+            }
+        }
+        // a write may have raced the read: check the current bytes against the current checksum
+        else if (known && readLump(job.offset, job.length, data) && crc32c(data.data(), data.size()) == it->second.crc) {
+            report.verified++;
+            continue;
+        }
+
+        size_t index = extent->second;
+        while (index > 0 && descriptors[index].name == 0) {
+            --index;
+        }
+        report.corrupt.push_back({LumpName::unpack(descriptors[index].name), job.offset, job.length});
+    }
+
+    // newly recorded checksums become visible to verify-on-read
+    if (report.recorded > 0) {
+        install(buildSnapshot());
+    }
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return report;
 }
 
 
@@ -625,22 +1933,31 @@ void Wad::printTree(const Node* node, const std::string& prefix) {
     if (!node) return;
 
     // Print the node's name with indent
-    std::cout << prefix << node->filename << "\n";
+    std::cout << prefix << LumpName::unpack(node->name) << "\n";
 
 
     // Recursively print each child 
     for (const auto& child : node->children) {
-        printTree(child, prefix + "  ");
+        printTree(child.get(), prefix + "  ");
     }
 }
 
-void Wad::printPathMap(const std::map<std::string, Node*>& pathMap) {
+void Wad::printPathMap() {
+    ReadGuard guard(*this);
+    std::map<std::string, const Node*> pathMap;
+    guard.snapshot->forEachShard([&](const Snapshot::PathShard &shard) {
+        for (const auto& [path, node] : shard) {
+            pathMap[path] = node.get();
+        }
+    });
+
     std::cout << "PathMap Contents:\n";
+    std::cout << "Version: " << guard.snapshot->version << "\n";
     for (const auto& [path, node] : pathMap) {
         // Print the path and the node name
         std::cout << path << " -> " 
                   << (node->isDirectory ? "[DIR] " : "[FILE] ") 
-                  << node->filename << std::endl;
+                  << LumpName::unpack(node->name) << std::endl;
     }
 }
 
@@ -7,38 +7,232 @@
 #include <fstream>
 #include <cstring>
 #include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
-struct Node {
-    std::string filename;
+// Lump names are at most 8 bytes on disk. In memory they are kept packed
+// little-endian into a uint64_t so comparisons are single integer compares;
+// strings are only built at the API boundary.
+namespace LumpName {
+    constexpr uint64_t pack(const char *name, size_t length = 8) {
+        uint64_t key = 0;
+        for (size_t i = 0; i < length && i < 8 && name[i] != '\0'; ++i) {
+            key |= static_cast<uint64_t>(static_cast<unsigned char>(name[i])) << (8 * i);
+        }
+        return key;
+    }
+
+    inline uint64_t pack(const std::string &name) {
+        return pack(name.data(), name.size());
+    }
+
+    inline size_t length(uint64_t key) {
+        return key == 0 ? 0 : 8 - __builtin_clzll(key) / 8;
+    }
+
+    inline std::string unpack(uint64_t key) {
+        char name[8];
+        std::memcpy(name, &key, 8);
+        return std::string(name, length(key));
+    }
+
+    // a + b, truncated to the 8 bytes a descriptor can hold
+    inline uint64_t concat(uint64_t a, uint64_t b) {
+        size_t len = length(a);
+        return len >= 8 ? a : a | (b << (8 * len));
+    }
+
+    // true if key is "<at least one byte><suffix>"
+    inline bool hasSuffix(uint64_t key, uint64_t suffix) {
+        size_t len = length(key);
+        size_t suffixLen = length(suffix);
+        return len > suffixLen && (key >> (8 * (len - suffixLen))) == suffix;
+    }
+
+    inline uint64_t stripSuffix(uint64_t key, uint64_t suffix) {
+        size_t keep = length(key) - length(suffix);
+        return keep == 0 ? 0 : key & ((1ULL << (8 * keep)) - 1);
+    }
+
+    // exactly E#M#
+    inline bool isMapMarker(uint64_t key) {
+        return (key & 0xFFFFFFFF00FF00FFULL) == ('E' | ('M' << 16)) &&
+               ((key >> 8) & 0xFF) - '0' < 10u &&
+               ((key >> 24) & 0xFF) - '0' < 10u;
+    }
+
+    // E#M# anywhere in the name
+    inline bool containsMapMarker(uint64_t key) {
+        for (size_t shift = 0; shift <= 32; shift += 8) {
+            if (isMapMarker((key >> shift) & 0xFFFFFFFFULL)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    constexpr uint64_t START = pack("_START");
+    constexpr uint64_t END = pack("_END");
+}
+
+// Lump data is checksummed in blocks of this many bytes, counted from the start of each extent.
+const size_t CRC_BLOCK = 64 << 10;
+
+// A contiguous run of lump bytes. A file's first extent lives in its own descriptor;
+// further extents follow it as continuation descriptors with an empty name.
+struct Extent {
     size_t offset;
     size_t length;
+    std::vector<uint32_t> crcs;     // CRC32C of each CRC_BLOCK of the extent; empty if unknown
+
+    size_t blocks() const { return (length + CRC_BLOCK - 1) / CRC_BLOCK; }
+    size_t blockLength(size_t block) const {
+        size_t start = block * CRC_BLOCK;
+        return length - start < CRC_BLOCK ? length - start : CRC_BLOCK;
+    }
+};
+
+struct Node;
+
+// Children of a directory, kept in a persistent 64-ary tree. Copying a list is O(1);
+// replacing or appending a child copies only the blocks on that child's path, so a new
+// version of a large directory shares almost all of it with the previous one.
+class ChildList {
+    public:
+    typedef std::shared_ptr<const Node> value_type;
+
+    ChildList() = default;
+    explicit ChildList(const std::vector<value_type> &children);
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const value_type& operator[](size_t index) const;
+    void set(size_t index, value_type child);
+    void push_back(value_type child);
+
+    class const_iterator {
+        public:
+        const_iterator(const ChildList *list, size_t index) : list(list), index(index) {}
+        const value_type& operator*() const { return (*list)[index]; }
+        const value_type* operator->() const { return &(*list)[index]; }
+        const_iterator& operator++() { ++index; return *this; }
+        bool operator==(const const_iterator &other) const { return index == other.index; }
+        bool operator!=(const const_iterator &other) const { return index != other.index; }
+
+        private:
+        const ChildList *list;
+        size_t index;
+    };
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, count); }
+
+    private:
+    static const unsigned BITS = 6;
+    static const size_t WIDTH = size_t(1) << BITS;
+    struct Block {
+        std::vector<std::shared_ptr<const Block>> blocks;   // inner levels
+        std::vector<value_type> nodes;                      // leaf level
+    };
+    static std::shared_ptr<const Block> setIn(const std::shared_ptr<const Block> &block, unsigned shift,
+                                              size_t index, value_type child);
+
+    std::shared_ptr<const Block> root;
+    size_t count = 0;
+    unsigned shift = 0;             // BITS per level above the leaves
+};
+
+struct Node {
+    uint64_t name;
+    size_t length;                  // total bytes across all extents
+    std::vector<Extent> extents;
     bool isDirectory;
-    std::vector<Node*> children;
+    ChildList children;
+    size_t slot = 0;                // position among the parent's children, stable across versions
     //std::map<std::string, Node*> pathMap;
     
 
-    Node(std::string filename, size_t offset, size_t length, bool isDirectory);
-    ~Node() {
-        for (Node* child: children) {
-            delete child;
+    Node(uint64_t name, size_t offset, size_t length, bool isDirectory);
+};
+
+// One immutable version of the tree and its path index. Published versions are
+// never modified: writers copy the nodes on the changed path (and the index
+// shards holding them) into a new version and swap it in, so unchanged
+// subtrees and shards are shared between versions. The index is two levels of
+// SHARDS: a change copies one group of shard pointers and one shard of about
+// 1/4096 of the paths. Missing groups and shards are empty.
+struct Snapshot {
+    static const size_t SHARDS = 64;
+    typedef std::unordered_map<std::string, std::shared_ptr<const Node>> PathShard;
+    typedef std::array<std::shared_ptr<const PathShard>, SHARDS> ShardGroup;
+
+    std::shared_ptr<const Node> root;
+    std::array<std::shared_ptr<const ShardGroup>, SHARDS> pathMap;
+    uint64_t version = 0;
+
+    static size_t shardOf(const std::string &path);
+    const Node* find(const std::string &path) const;
+    void set(const std::string &path, std::shared_ptr<const Node> node);
+
+    template <typename F>
+    void forEachShard(F f) const {
+        for (const auto& group : pathMap) {
+            for (size_t i = 0; group != nullptr && i < SHARDS; ++i) {
+                if ((*group)[i] != nullptr) {
+                    f(*(*group)[i]);
+                }
+            }
         }
     }
 };
 
 struct Descriptor {
-    std::string name;
+    uint64_t name;
     size_t offset;
     size_t length;
 
-    Descriptor(const std::string &name, size_t offset, size_t length);
+    Descriptor(uint64_t name, size_t offset, size_t length);
     Descriptor();
+
+    // an unused slot kept in the table so an insert nearby shifts only a few descriptors
+    bool isSpare() const { return name == 0 && length == 0; }
+};
+
+
+struct DedupStats {
+    size_t lumps = 0;           // descriptors that carry lump data
+    size_t uniqueLumps = 0;     // distinct lump contents
+    size_t sharedLumps = 0;     // descriptors already aliasing another lump's offset
+    size_t totalBytes = 0;      // bytes referenced by all descriptors
+    size_t storedBytes = 0;     // bytes actually stored in the lump area
+    size_t duplicateBytes = 0;  // bytes that dedup could reclaim
+    size_t unreferencedBytes = 0;  // lump area bytes no descriptor points at
+};
+
+struct ScrubError {
+    std::string name;           // lump the damaged block belongs to
+    size_t offset;
+    size_t length;
+};
+
+struct ScrubReport {
+    size_t blocks = 0;          // distinct checksum blocks read
+    size_t bytes = 0;           // lump bytes read
+    size_t verified = 0;        // blocks matching their recorded checksum
+    size_t recorded = 0;        // blocks that had no checksum yet and now have one
+    size_t unchecked = 0;       // read-only scrub: blocks with no checksum to compare against
+    std::vector<ScrubError> corrupt;
+    double seconds = 0;
 };
 
 
 class Wad {
     public:
     void printTree(const Node* node, const std::string& prefix = "");
-    void printPathMap(const std::map<std::string, Node*>& pathMap);
+    void printPathMap();
     void shiftDescriptorsForSpace(size_t spaceNeeded);
     static Wad* loadWad(const std::string &path);
     ~Wad();
@@ -51,9 +245,22 @@ class Wad {
     void createDirectory(const std::string &path);
     void createFile(const std::string &path);
     int writeToFile(const std::string &path, const char *buffer, int length, int offset = 0);
+    int mergeExtents();
+    void setReserve(size_t bytes);
+    void setDedup(bool enabled);
+    int dedupFile(const std::string &path);
+    bool isDedup() const { return dedup; }
+    DedupStats getDedupStats();
+    void printDedupReport();
+    void setVerify(bool enabled);
+    bool isVerify() const { return verify.load(); }
+    bool isExclusive() const { return exclusive; }
+    bool isLoaded() const { return loaded; }
+    ScrubReport scrub(unsigned threads = 0);
 
-    Node* getRoot() { return root; }               
-    const Node* getRoot() const { return root; }
+    std::shared_ptr<const Node> getRoot();
+    uint64_t getVersion();
+    size_t getMemoryUsage();
 
     
 
@@ -62,13 +269,97 @@ class Wad {
     private:
     Wad(const std::string &path);
     std::fstream wad;
+    std::string wadPath;
+    int fd = -1;                            // read-only handle for lock-free pread
     std::string magic;
+
+    // Readers never lock: they pin the current snapshot through an epoch slot.
+    // Everything below writeMutex is writer state and is only touched under it.
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch{0};     // 0 = free, otherwise epoch the reader entered in
+    };
+    static const size_t READER_SLOTS = 64;
+    ReaderSlot readers[READER_SLOTS];
+    std::atomic<uint64_t> globalEpoch{1};
+    std::atomic<const Snapshot*> current{nullptr};
+
+    class ReadGuard {
+        public:
+        explicit ReadGuard(Wad &wad);
+        ~ReadGuard();
+        const Snapshot* snapshot;
+
+        private:
+        Wad &wad;
+        size_t slot;
+    };
+
+    std::mutex writeMutex;
+    std::vector<std::pair<uint64_t, const Snapshot*>> retired;
     std::vector<Descriptor> descriptors; 
     int numDescriptors = 0;
     int descriptorOffset = 0;
-    Node* root;
-    std::map<std::string, Node*> pathMap;
-    
+
+    // file path -> index of its first descriptor, and per descriptor the entry pointing at
+    // it, so an insert or erase in the table renumbers only the entries after it
+    std::unordered_map<std::string, size_t> descriptorIndex;
+    std::vector<size_t*> descriptorSlots;
+    void linkDescriptorIndex();
+    void shiftDescriptorIndex(size_t at, std::ptrdiff_t delta, size_t to = SIZE_MAX);
+    void indexFileDescriptor(const std::string &path, size_t index);
+    size_t insertDescriptor(size_t at, const Descriptor &desc, size_t floor = 0);
+
+    // Lump data ends at dataEnd; the bytes up to descriptorOffset are headroom that new
+    // lumps fill without moving the table. reserve is the headroom left when it does move.
+    size_t dataEnd = 12;
+    size_t reserve = 0;
+    size_t allocateLump(size_t length);
+    Snapshot* buildSnapshot(std::unordered_map<std::string, size_t>* fileDescriptors = nullptr) const;
+    void publish(const std::string &path, std::shared_ptr<Node> node);
+    void install(Snapshot* next);
+    void reclaim();
+
+    // content-addressed dedup: lump hash -> offsets of lumps with that hash,
+    // and lump offset -> number of descriptors referencing it (copy-on-write)
+    bool dedup = false;
+    std::unordered_map<uint64_t, std::vector<size_t>> lumpIndex;
+    std::map<size_t, int> lumpRefs;
+    bool isSharedLump(size_t offset) const;
+    bool readLump(size_t offset, size_t length, std::string &data);
+    void buildLumpIndex();
+    bool findDuplicateLump(const char *buffer, size_t length, uint64_t hash, size_t &offset);
+    size_t findDescriptor(uint64_t name, size_t from = 0) const;
+    size_t findFileDescriptor(const std::string &path) const;
+    void writeDescriptors(size_t from = 0, size_t to = SIZE_MAX);
+    void writeDescriptor(size_t index);
+    bool readExtents(const Node &node, std::string &data);
+    void writeInPlace(Node &node, size_t offset, const char *data, size_t length);
+    void appendToFile(Node &node, size_t fileIndex, const char *data, size_t length);
+    void replaceExtents(Node &node, size_t fileIndex, const std::string &data);
+    void repointFile(Node &node, size_t fileIndex, size_t offset, size_t length);
+    void releaseTail(std::vector<Extent> released);
+
+    // CRC32C of every CRC_BLOCK of lump data keyed by the block's offset, mirrored in an
+    // append-only <wad>.crc sidecar where later records supersede earlier ones. Extents in
+    // the snapshot carry their block checksums too, so verify-on-read needs no lock.
+    struct Checksum {
+        size_t length;
+        uint32_t crc;
+    };
+    std::atomic<bool> verify{false};
+    bool exclusive = false;                 // holds flock on the WAD, and so owns the sidecar
+    bool loaded = false;                    // header and descriptor table were read in full
+    std::string crcPath;
+    int crcFd = -1;
+    size_t crcRecords = 0;
+    std::unordered_map<size_t, Checksum> checksums;
+    void loadChecksums();
+    size_t readChecksums(std::unordered_map<size_t, Checksum> &into) const;
+    std::vector<uint32_t> checksumBlocks(size_t offset, const char *data, size_t length);
+    void recordChecksum(Extent &extent, size_t block, uint32_t crc);
+    void appendChecksum(size_t offset, size_t length, uint32_t crc);
+    void compactChecksums();
+    bool verifyRange(const Extent &extent, size_t pos, size_t length, const char *data) const;
 };
 
 #endif // WAD_H
\ No newline at end of file
@@ -0,0 +1,597 @@
+// wadbench: mounts a WAD through wadfs in a temp directory and drives real
+// kernel/FUSE traffic against it, reporting throughput and latency per operation.
+//
+// usage: wadbench [options] <wad|dir> [-- wadfs options]
+//   --wadfs PATH       wadfs binary (default ../wadfs/wadfs)
+//   --workload NAME    stat | list | randread | seqread | create | mixed (default mixed);
+//                      list does a full recursive listing per op, create makes and writes files
+//   --trace FILE       replay a recorded op trace instead of a workload
+//   --threads N        concurrent client threads (default 4)
+//   --ops N            operations per thread (default 1000)
+//   --read-size N      bytes per read call (default 4096)
+//   --fuse-single      run wadfs single-threaded (-s); by default it serves requests concurrently
+//   -- ARGS            everything after -- is passed to wadfs ahead of the WAD,
+//                      e.g. -- --verify --reserve 65536
+//
+// Given a directory, every *.wad in it is staged and served in wadfs directory mode;
+// the create workload then works inside the first archive.
+//
+// Trace files have one operation per line: "[time] <op> <path> [size] [offset]" where op is
+// stat, readdir, read, mkdir, create or write. Lines starting with '#' are ignored.
+// Lines are spread over threads by path, so operations on one file keep their order, and an
+// operation waits for the last earlier change to its path or one of its parent directories
+// (a write never overtakes its create). A leading time in seconds holds the operation back
+// until that long after the replay started.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string wadfs = "../wadfs/wadfs";
+    std::string workload = "mixed";
+    std::string trace;
+    std::string wad;
+    int threads = 4;
+    int ops = 1000;
+    size_t readSize = 4096;
+    bool fuseSingle = false;
+    std::vector<std::string> wadfsArgs;
+};
+
+struct TraceOp {
+    double at = -1;             // seconds after the replay started, if the trace is timed
+    std::string op;
+    std::string path;
+    size_t size = 0;
+    off_t offset = 0;
+    long after = -1;            // earlier operation this one has to wait for
+};
+
+// per-thread latency samples (nanoseconds) keyed by operation name
+struct Samples {
+    std::map<std::string, std::vector<uint64_t>> latencies;
+    std::map<std::string, uint64_t> errors;
+};
+
+static std::string mountPoint;
+static std::vector<std::string> files;      // mount-relative paths of content files
+static std::vector<std::string> dirs;       // mount-relative paths of directories
+static std::vector<off_t> fileSizes;
+static std::string createRoot;              // where the create workload makes its directories
+
+static void usage() {
+    std::cout << "usage: wadbench [--wadfs PATH] [--workload stat|list|randread|seqread|create|mixed]\n"
+              << "                [--trace FILE] [--threads N] [--ops N] [--read-size N] [--fuse-single]\n"
+              << "                <wad|dir> [-- wadfs options]" << std::endl;
+}
+
+static bool parseOptions(int argc, char* argv[], Options &opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--wadfs" && hasValue) {
+            opts.wadfs = argv[++i];
+        }
+        else if (arg == "--workload" && hasValue) {
+            opts.workload = argv[++i];
+        }
+        else if (arg == "--trace" && hasValue) {
+            opts.trace = argv[++i];
+        }
+        else if (arg == "--threads" && hasValue) {
+            opts.threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--ops" && hasValue) {
+            opts.ops = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--read-size" && hasValue) {
+            opts.readSize = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--fuse-single") {
+            opts.fuseSingle = true;
+        }
+        else if (arg == "--") {
+            opts.wadfsArgs.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else if (!arg.empty() && arg[0] != '-' && opts.wad.empty()) {
+            opts.wad = arg;
+        }
+        else {
+            return false;
+        }
+    }
+    return !opts.wad.empty();
+}
+
+// fork/exec a command and wait for it, returns the exit status
+static int runCommand(const std::vector<std::string> &args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::vector<char*> argv;
+        for (const auto &arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool copyFile(const std::string &from, const std::string &to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary);
+    if (!in || !out) {
+        return false;
+    }
+    out << in.rdbuf();
+    return static_cast<bool>(out);
+}
+
+// copies every *.wad in from into to
+static bool stageArchives(const std::string &from, const std::string &to) {
+    DIR *dir = opendir(from.c_str());
+    if (dir == nullptr || mkdir(to.c_str(), 0755) != 0) {
+        if (dir != nullptr) {
+            closedir(dir);
+        }
+        return false;
+    }
+    bool staged = false;
+    while (struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.length() > 4 && strcasecmp(name.c_str() + name.length() - 4, ".wad") == 0) {
+            staged = copyFile(from + "/" + name, to + "/" + name) || staged;
+        }
+    }
+    closedir(dir);
+    return staged;
+}
+
+// removes the staged copies, their checksum sidecars and the temp directory
+static void removeAll(const std::string &path) {
+    if (DIR *dir = opendir(path.c_str())) {
+        while (struct dirent *entry = readdir(dir)) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                removeAll(path + "/" + entry->d_name);
+            }
+        }
+        closedir(dir);
+        rmdir(path.c_str());
+    }
+    else {
+        unlink(path.c_str());
+    }
+}
+
+// the mount is live once the mount point sits on a different device than its parent
+static bool waitForMount(const std::string &parent) {
+    struct stat parentStat;
+    struct stat mountStat;
+    if (stat(parent.c_str(), &parentStat) != 0) {
+        return false;
+    }
+    for (int i = 0; i < 100; ++i) {
+        if (stat(mountPoint.c_str(), &mountStat) == 0 && mountStat.st_dev != parentStat.st_dev) {
+            return true;
+        }
+        usleep(50000);
+    }
+    return false;
+}
+
+static void discover(const std::string &relPath) {
+    dirs.push_back(relPath);
+    DIR *dir = opendir((mountPoint + relPath).c_str());
+    if (dir == nullptr) {
+        return;
+    }
+    std::vector<std::string> children;
+    while (struct dirent *entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            children.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    for (const auto &child : children) {
+        std::string childPath = relPath + (relPath == "/" ? "" : "/") + child;
+        struct stat st;
+        if (stat((mountPoint + childPath).c_str(), &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            discover(childPath);
+        }
+        else {
+            files.push_back(childPath);
+            fileSizes.push_back(st.st_size);
+        }
+    }
+}
+
+// times one operation; a negative result counts as an error
+template <typename Op>
+static void timed(Samples &samples, const std::string &name, Op op) {
+    auto start = Clock::now();
+    int result = op();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    samples.latencies[name].push_back(elapsed);
+    if (result < 0) {
+        samples.errors[name]++;
+    }
+}
+
+static void doStat(Samples &samples, const std::string &path) {
+    timed(samples, "stat", [&] {
+        struct stat st;
+        return stat((mountPoint + path).c_str(), &st);
+    });
+}
+
+static void doReaddir(Samples &samples, const std::string &path) {
+    timed(samples, "readdir", [&] {
+        DIR *dir = opendir((mountPoint + path).c_str());
+        if (dir == nullptr) {
+            return -1;
+        }
+        while (readdir(dir) != nullptr) {
+        }
+        closedir(dir);
+        return 0;
+    });
+}
+
+static void doRead(Samples &samples, const std::string &path, std::vector<char> &buffer, size_t size, off_t offset) {
+    int fd = -1;
+    timed(samples, "open", [&] {
+        fd = open((mountPoint + path).c_str(), O_RDONLY);
+        return fd;
+    });
+    if (fd < 0) {
+        return;
+    }
+    buffer.resize(std::max(buffer.size(), size));
+    timed(samples, "read", [&] {
+        return static_cast<int>(pread(fd, buffer.data(), size, offset));
+    });
+    close(fd);
+}
+
+static void doSequentialRead(Samples &samples, const std::string &path, std::vector<char> &buffer, size_t readSize) {
+    int fd = -1;
+    timed(samples, "open", [&] {
+        fd = open((mountPoint + path).c_str(), O_RDONLY);
+        return fd;
+    });
+    if (fd < 0) {
+        return;
+    }
+    buffer.resize(std::max(buffer.size(), readSize));
+    ssize_t got = 1;
+    while (got > 0) {
+        timed(samples, "read", [&] {
+            got = read(fd, buffer.data(), readSize);
+            return static_cast<int>(got);
+        });
+    }
+    close(fd);
+}
+
+static void doMkdir(Samples &samples, const std::string &path) {
+    timed(samples, "mkdir", [&] {
+        return mkdir((mountPoint + path).c_str(), 0755);
+    });
+}
+
+static void doCreate(Samples &samples, const std::string &path) {
+    timed(samples, "create", [&] {
+        return mknod((mountPoint + path).c_str(), S_IFREG | 0644, 0);
+    });
+}
+
+static void doWrite(Samples &samples, const std::string &path, std::vector<char> &buffer, size_t size, off_t offset) {
+    int fd = open((mountPoint + path).c_str(), O_WRONLY);
+    if (fd < 0) {
+        samples.errors["write"]++;
+        return;
+    }
+    buffer.resize(std::max(buffer.size(), size));
+    timed(samples, "write", [&] {
+        return static_cast<int>(pwrite(fd, buffer.data(), size, offset));
+    });
+    close(fd);
+}
+
+static void runWorkload(const Options &opts, int thread, Samples &samples) {
+    std::mt19937_64 rng(thread * 7919 + 1);
+    std::vector<char> buffer(opts.readSize, 'w');
+
+    // directory names are limited to 2 characters and file names to 8
+    std::string createDir = createRoot + "/b" + std::string(1, static_cast<char>('a' + thread % 26));
+    if (opts.workload == "create" && thread < 26) {
+        doMkdir(samples, createDir);
+    }
+
+    for (int i = 0; i < opts.ops; ++i) {
+        std::string kind = opts.workload;
+        if (kind == "mixed") {
+            static const char *mix[] = {"stat", "stat", "stat", "list", "randread", "randread"};
+            kind = mix[rng() % 6];
+        }
+
+        if (kind == "stat") {
+            const auto &pool = (files.empty() || rng() % 4 == 0) ? dirs : files;
+            doStat(samples, pool[rng() % pool.size()]);
+        }
+        else if (kind == "list") {
+            // one recursive listing of the whole tree
+            for (const auto &dir : dirs) {
+                doReaddir(samples, dir);
+            }
+        }
+        else if (kind == "randread" && !files.empty()) {
+            size_t pick = rng() % files.size();
+            off_t size = fileSizes[pick];
+            off_t offset = size > 0 ? static_cast<off_t>(rng() % size) : 0;
+            doRead(samples, files[pick], buffer, opts.readSize, offset);
+        }
+        else if (kind == "seqread" && !files.empty()) {
+            doSequentialRead(samples, files[rng() % files.size()], buffer, opts.readSize);
+        }
+        else if (kind == "create") {
+            char name[9];
+            snprintf(name, sizeof(name), "c%07X", static_cast<unsigned>(thread << 20 | i) & 0xFFFFFFFu);
+            std::string path = (thread < 26 ? createDir : createRoot) + "/" + name;
+            doCreate(samples, path);
+            doWrite(samples, path, buffer, opts.readSize, 0);
+        }
+    }
+}
+
+static bool loadTrace(const std::string &path, std::vector<TraceOp> &trace) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        TraceOp op;
+        fields >> op.op;
+        char *end = nullptr;
+        double at = strtod(op.op.c_str(), &end);
+        if (!op.op.empty() && *end == '\0') {
+            op.at = at;
+            fields >> op.op;
+        }
+        fields >> op.path >> op.size >> op.offset;
+        if (!op.op.empty() && !op.path.empty()) {
+            trace.push_back(op);
+        }
+    }
+    return true;
+}
+
+static bool changesPath(const TraceOp &op) {
+    return op.op == "mkdir" || op.op == "create" || op.op == "write";
+}
+
+// An operation depends on the last earlier change to its path or to a parent directory; a
+// change also depends on the last earlier operation of any kind on its path.
+static void orderTrace(std::vector<TraceOp> &trace) {
+    std::map<std::string, long> lastChange;
+    std::map<std::string, long> lastAny;
+    for (long i = 0; i < static_cast<long>(trace.size()); ++i) {
+        TraceOp &op = trace[i];
+        while (op.path.length() > 1 && op.path.back() == '/') {
+            op.path.pop_back();
+        }
+        std::string path = op.path;
+        while (true) {
+            auto it = lastChange.find(path);
+            if (it != lastChange.end()) {
+                op.after = std::max(op.after, it->second);
+            }
+            if (path == "/") {
+                break;
+            }
+            size_t slash = path.find_last_of('/');
+            path = slash == 0 ? "/" : path.substr(0, slash);
+        }
+        if (changesPath(op)) {
+            auto it = lastAny.find(op.path);
+            if (it != lastAny.end()) {
+                op.after = std::max(op.after, it->second);
+            }
+            lastChange[op.path] = i;
+        }
+        lastAny[op.path] = i;
+    }
+}
+
+// Replays the operations assigned to this thread in trace order. Waiting only on earlier
+// operations cannot deadlock: the earliest unfinished operation never waits.
+static void replayTrace(const Options &opts, const std::vector<TraceOp> &trace, const std::vector<size_t> &assigned,
+                        std::vector<std::atomic<bool>> &done, Clock::time_point start, Samples &samples) {
+    std::vector<char> buffer(opts.readSize, 'w');
+    for (size_t i : assigned) {
+        const TraceOp &op = trace[i];
+        if (op.at >= 0) {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(op.at)));
+        }
+        while (op.after >= 0 && !done[op.after].load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        size_t size = op.size > 0 ? op.size : opts.readSize;
+        if (op.op == "stat") {
+            doStat(samples, op.path);
+        }
+        else if (op.op == "readdir") {
+            doReaddir(samples, op.path);
+        }
+        else if (op.op == "read") {
+            doRead(samples, op.path, buffer, size, op.offset);
+        }
+        else if (op.op == "mkdir") {
+            doMkdir(samples, op.path);
+        }
+        else if (op.op == "create") {
+            doCreate(samples, op.path);
+        }
+        else if (op.op == "write") {
+            doWrite(samples, op.path, buffer, size, op.offset);
+        }
+        else {
+            samples.errors[op.op]++;
+        }
+        done[i].store(true, std::memory_order_release);
+    }
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+static void report(std::vector<Samples> &perThread, double seconds) {
+    std::map<std::string, std::vector<uint64_t>> merged;
+    std::map<std::string, uint64_t> errors;
+    for (auto &samples : perThread) {
+        for (auto &[name, latencies] : samples.latencies) {
+            auto &all = merged[name];
+            all.insert(all.end(), latencies.begin(), latencies.end());
+        }
+        for (auto &[name, count] : samples.errors) {
+            errors[name] += count;
+        }
+    }
+
+    std::cout << std::left << std::setw(10) << "op" << std::right
+              << std::setw(10) << "count" << std::setw(12) << "ops/s"
+              << std::setw(12) << "p50 us" << std::setw(12) << "p99 us"
+              << std::setw(12) << "p999 us" << std::setw(8) << "errors" << "\n";
+    for (auto &[name, latencies] : merged) {
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << latencies.size()
+                  << std::setw(12) << latencies.size() / seconds
+                  << std::setw(12) << percentile(latencies, 0.50)
+                  << std::setw(12) << percentile(latencies, 0.99)
+                  << std::setw(12) << percentile(latencies, 0.999)
+                  << std::setw(8) << errors[name] << "\n";
+    }
+    std::cout << "wall time: " << std::setprecision(3) << seconds << " s" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    if (!parseOptions(argc, argv, opts)) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    std::vector<TraceOp> trace;
+    if (!opts.trace.empty() && !loadTrace(opts.trace, trace)) {
+        std::cout << "Cannot read trace: " << opts.trace << std::endl;
+        return EXIT_FAILURE;
+    }
+    orderTrace(trace);
+    std::vector<std::vector<size_t>> assigned(opts.threads);
+    for (size_t i = 0; i < trace.size(); ++i) {
+        assigned[std::hash<std::string>{}(trace[i].path) % opts.threads].push_back(i);
+    }
+    std::vector<std::atomic<bool>> done(trace.size());
+
+    // work on a copy so create/write workloads never touch the original WAD
+    char tempTemplate[] = "/tmp/wadbench.XXXXXX";
+    if (mkdtemp(tempTemplate) == nullptr) {
+        std::cout << "Cannot create temp directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string tempDir = tempTemplate;
+    struct stat wadStat;
+    bool directoryMode = stat(opts.wad.c_str(), &wadStat) == 0 && S_ISDIR(wadStat.st_mode);
+    std::string wadCopy = tempDir + (directoryMode ? "/wads" : "/bench.wad");
+    mountPoint = tempDir + "/mnt";
+    bool staged = directoryMode ? stageArchives(opts.wad, wadCopy) : copyFile(opts.wad, wadCopy);
+    if (!staged || mkdir(mountPoint.c_str(), 0755) != 0) {
+        std::cout << "Cannot stage " << opts.wad << " in " << tempDir << std::endl;
+        removeAll(tempDir);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> mountArgs = {opts.wadfs};
+    mountArgs.insert(mountArgs.end(), opts.wadfsArgs.begin(), opts.wadfsArgs.end());
+    if (opts.fuseSingle) {
+        mountArgs.push_back("-s");
+    }
+    mountArgs.push_back(wadCopy);
+    mountArgs.push_back(mountPoint);
+    if (runCommand(mountArgs) != 0 || !waitForMount(tempDir)) {
+        std::cout << "Failed to mount " << wadCopy << " with " << opts.wadfs << std::endl;
+        removeAll(tempDir);
+        return EXIT_FAILURE;
+    }
+
+    discover("/");
+    if (directoryMode && dirs.size() > 1) {
+        // dirs[0] is the mount root, dirs[1] the first archive
+        createRoot = dirs[1];
+    }
+    std::cout << "Mounted " << opts.wad << ": " << files.size() << " files, " << dirs.size() << " directories" << std::endl;
+
+    std::vector<Samples> perThread(opts.threads);
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    for (int t = 0; t < opts.threads; ++t) {
+        workers.emplace_back([&, t] {
+            if (!trace.empty()) {
+                replayTrace(opts, trace, assigned[t], done, start, perThread[t]);
+            }
+            else {
+                runWorkload(opts, t, perThread[t]);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    report(perThread, seconds);
+
+    runCommand({"fusermount", "-u", mountPoint});
+    removeAll(tempDir);
+    return EXIT_SUCCESS;
+}
@@ -2,6 +2,7 @@
 #include <fuse.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <time.h>
 #include <string.h>
@@ -10,11 +11,266 @@
 #include <iostream>
 #include <string>
 #include <unordered_set>
+#include <dirent.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "/home/reptilian/P3/libWad/Wad.h"
 
 Wad *wadObject = nullptr;
 
+// Serves every *.wad file in a directory as /<name>/ from one process. Archives are loaded
+// on first use and their tree/index memory is charged to one shared budget: when the loaded
+// archives exceed it, the least recently used ones that no operation is holding are
+// unloaded. A sweeper thread also unloads archives that have been idle for idleSeconds.
+class ArchivePool {
+    public:
+    ArchivePool(const std::string &dir, size_t budget, time_t idleSeconds, bool dedup, size_t reserve, bool verify)
+        : dir(dir), budget(budget), idleSeconds(idleSeconds), dedup(dedup), reserve(reserve), verify(verify) {}
+
+    void scan() {
+        DIR *wadDir = opendir(dir.c_str());
+        if (wadDir == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        while (struct dirent *entry = readdir(wadDir)) {
+            std::string file = entry->d_name;
+            if (file.length() <= 4 || strcasecmp(file.c_str() + file.length() - 4, ".wad") != 0) {
+                continue;
+            }
+            std::string name = file.substr(0, file.length() - 4);
+            if (archives.find(name) == archives.end()) {
+                archives[name].path = dir + "/" + file;
+                archives[name].loading = std::make_shared<std::mutex>();
+            }
+        }
+        closedir(wadDir);
+    }
+
+    bool contains(const std::string &name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return archives.find(name) != archives.end();
+    }
+
+    std::vector<std::string> names() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string> result;
+        for (const auto &[name, archive] : archives) {
+            result.push_back(name);
+        }
+        return result;
+    }
+
+    // The returned pointer keeps the archive loaded for as long as the caller holds it.
+    std::shared_ptr<Wad> acquire(const std::string &name) {
+        std::shared_ptr<std::mutex> loading;
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = archives.find(name);
+            if (it == archives.end()) {
+                return nullptr;
+            }
+            it->second.lastUsed = time(NULL);
+            if (it->second.wad) {
+                return it->second.wad;
+            }
+            loading = it->second.loading;
+            path = it->second.path;
+        }
+
+        // load outside the pool lock so other archives keep serving meanwhile
+        std::lock_guard<std::mutex> loadLock(*loading);
+        std::shared_ptr<Wad> retired;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Archive &archive = archives[name];
+            if (archive.wad) {
+                return archive.wad;
+            }
+            retired.swap(archive.retired);
+        }
+        // the previous instance lets go of the file (and its lock) before it is reopened
+        retired.reset();
+        std::shared_ptr<Wad> wad(Wad::loadWad(path));
+        wad->setDedup(dedup);
+        wad->setReserve(reserve);
+        wad->setVerify(verify);
+        uint64_t version = wad->getVersion();
+        size_t bytes = wad->getMemoryUsage();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Archive &archive = archives[name];
+        archive.wad = wad;
+        archive.bytes = bytes;
+        archive.measuredVersion = version;
+        archive.lastUsed = archive.measuredAt = time(NULL);
+        used += bytes;
+        enforceBudget(name);
+        return wad;
+    }
+
+    // Unloads idle archives and re-measures the ones that changed. getMemoryUsage walks the
+    // whole tree and waits for the archive's writers, so an archive is measured at most once
+    // per MEASURE_SECONDS, only after a write, and without the pool lock.
+    void sweep() {
+        std::vector<std::pair<std::string, std::shared_ptr<Wad>>> measured;
+        std::vector<uint64_t> versions;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            time_t now = time(NULL);
+            for (auto &[name, archive] : archives) {
+                if (!archive.wad) {
+                    continue;
+                }
+                if (now - archive.lastUsed >= idleSeconds && archive.wad.use_count() == 1) {
+                    unload(archive);
+                    continue;
+                }
+                uint64_t version = archive.wad->getVersion();
+                if (version != archive.measuredVersion && now - archive.measuredAt >= MEASURE_SECONDS) {
+                    measured.emplace_back(name, archive.wad);
+                    versions.push_back(version);
+                }
+            }
+        }
+
+        // used is kept up to date by loads and unloads; only a new measurement changes it here
+        if (!measured.empty()) {
+            std::vector<size_t> bytes;
+            for (const auto &[name, wad] : measured) {
+                bytes.push_back(wad->getMemoryUsage());
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < measured.size(); ++i) {
+                // skip archives that were reloaded while measuring
+                Archive &archive = archives[measured[i].first];
+                if (archive.wad == measured[i].second) {
+                    archive.bytes = bytes[i];
+                    archive.measuredVersion = versions[i];
+                    archive.measuredAt = time(NULL);
+                }
+            }
+            measured.clear();
+            used = 0;
+            for (const auto &[name, archive] : archives) {
+                used += archive.wad ? archive.bytes : 0;
+            }
+            enforceBudget("");
+        }
+        closeRetired();
+    }
+
+    void startSweeper() {
+        std::thread([this] {
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                sweep();
+            }
+        }).detach();
+    }
+
+    private:
+    static const time_t MEASURE_SECONDS = 30;
+
+    struct Archive {
+        std::string path;
+        std::shared_ptr<Wad> wad;
+        std::shared_ptr<Wad> retired;           // unloaded, not yet closed
+        std::shared_ptr<std::mutex> loading;
+        size_t bytes = 0;
+        uint64_t measuredVersion = 0;           // version that bytes was measured at
+        time_t measuredAt = 0;
+        time_t lastUsed = 0;
+    };
+
+    // An archive is only unloaded while no operation holds it (use_count == 1, checked under
+    // the pool lock), so two Wad instances never write the same file at once. The instance
+    // is closed later, outside the pool lock, by closeRetired or the next load.
+    void unload(Archive &archive) {
+        archive.retired = std::move(archive.wad);
+        used -= std::min(used, archive.bytes);
+        archive.bytes = 0;
+    }
+
+    // Closes unloaded instances, each under its archive's loading lock so a reload cannot
+    // open the file before the old instance released it (and its sidecar lock).
+    void closeRetired() {
+        std::vector<std::pair<std::string, std::shared_ptr<std::mutex>>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto &[name, archive] : archives) {
+                if (archive.retired) {
+                    pending.emplace_back(name, archive.loading);
+                }
+            }
+        }
+        for (const auto &[name, loading] : pending) {
+            std::lock_guard<std::mutex> loadLock(*loading);
+            std::shared_ptr<Wad> retired;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                retired.swap(archives[name].retired);
+            }
+        }
+    }
+
+    void enforceBudget(const std::string &keep) {
+        while (used > budget) {
+            Archive *oldest = nullptr;
+            for (auto &[name, archive] : archives) {
+                if (name != keep && archive.wad && archive.wad.use_count() == 1 &&
+                    (oldest == nullptr || archive.lastUsed < oldest->lastUsed)) {
+                    oldest = &archive;
+                }
+            }
+            if (oldest == nullptr) {
+                // everything left is in use; run over budget until it is released
+                return;
+            }
+            unload(*oldest);
+        }
+    }
+
+    std::string dir;
+    size_t budget;
+    time_t idleSeconds;
+    bool dedup;
+    size_t reserve;
+    bool verify;
+    size_t used = 0;
+    std::mutex mutex;
+    std::map<std::string, Archive> archives;
+};
+
+ArchivePool *archivePool = nullptr;
+
+// Maps a mount path to the archive serving it and the path inside that archive. With one
+// WAD that is wadObject and the path itself; in multi-archive mode "/DOOM1/F/FLOOR1" is
+// served by DOOM1.wad as "/F/FLOOR1". Returns nullptr for unknown archives.
+static std::shared_ptr<Wad> resolve(const std::string &path, std::string &inner) {
+    if (archivePool == nullptr) {
+        inner = path;
+        return std::shared_ptr<Wad>(std::shared_ptr<Wad>(), wadObject);
+    }
+    size_t slash = path.find('/', 1);
+    std::string name = path.substr(1, slash == std::string::npos ? std::string::npos : slash - 1);
+    inner = slash == std::string::npos ? "/" : path.substr(slash);
+    return archivePool->acquire(name);
+}
+
+// true for "/" and, in multi-archive mode, for the "/<name>" directories of the archives
+static bool isArchiveRoot(const std::string &path) {
+    if (path == "/") {
+        return true;
+    }
+    return archivePool != nullptr && path.find('/', 1) == std::string::npos && archivePool->contains(path.substr(1));
+}
+
 // https://maastaar.net/fuse/linux/filesystem/c/2019/09/28/writing-less-simple-yet-stupid-filesystem-using-FUSE-in-C/
 
 static int do_getattr(const char *path, struct stat *st) {
@@ -24,15 +280,25 @@ static int do_getattr(const char *path, struct stat *st) {
 	st->st_mtime = time( NULL );
 
     std::string strPath(path);
+    if (isArchiveRoot(strPath)) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return 0;
+    }
 
-   if ( strcmp( path, "/" ) == 0 || wadObject->isDirectory(strPath)) {
+    std::shared_ptr<Wad> wad = resolve(strPath, strPath);
+    if (wad == nullptr) {
+        return -ENOENT;
+    }
+
+   if ( wad->isDirectory(strPath)) {
 		st->st_mode = S_IFDIR | 0755;
 		st->st_nlink = 2;
 	}
-	else if (wadObject->isContent(strPath)) {
+	else if (wad->isContent(strPath)) {
 		st->st_mode = S_IFREG | 0644;
 		st->st_nlink = 1;
-		st->st_size = wadObject->getSize(strPath);
+		st->st_size = wad->getSize(strPath);
 	}
 	else {
 		return -ENOENT;
@@ -45,8 +311,16 @@ static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, of
     std::vector<std::string> directory;
     std::string strPath(path);
 
-    if (wadObject->getDirectory(strPath, &directory) < 0) {
-        return -EIO;
+    if (archivePool != nullptr && strPath == "/") {
+        // listing the top level never loads an archive
+        archivePool->scan();
+        directory = archivePool->names();
+    }
+    else {
+        std::shared_ptr<Wad> wad = resolve(strPath, strPath);
+        if (wad == nullptr || wad->getDirectory(strPath, &directory) < 0) {
+            return -EIO;
+        }
     }
 
     filler(buffer, ".", nullptr, 0);
@@ -67,52 +341,141 @@ static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, of
 
 static int do_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
     std::string strPath(path);
-    if (!wadObject->isContent(strPath)) {
+    std::shared_ptr<Wad> wad = resolve(strPath, strPath);
+    if (wad == nullptr || !wad->isContent(strPath)) {
         return -ENOENT;
     }
 
-    int bytesRead = wadObject->getContents(strPath, buffer, size, offset);
+    int bytesRead = wad->getContents(strPath, buffer, size, offset);
     if (bytesRead > 0) {
         return bytesRead;
     }
+    if (bytesRead < 0) {
+        // unreadable, or failed verification under --verify
+        return -EIO;
+    }
     return -ENOENT;
 }
 
 int do_mkdir(const char *path, mode_t mode) {
     std::string strPath(path);
-    wadObject->createDirectory(strPath);
+    std::shared_ptr<Wad> wad = resolve(strPath, strPath);
+    if (wad == nullptr) {
+        return -ENOENT;
+    }
+    wad->createDirectory(strPath);
     return 0;
 }
 
 int do_mknod(const char *path, mode_t mode, dev_t dev) {
     std::string strPath(path);
-    wadObject->createFile(strPath);
+    std::shared_ptr<Wad> wad = resolve(strPath, strPath);
+    if (wad == nullptr) {
+        return -ENOENT;
+    }
+    wad->createFile(strPath);
     return 0;
 }   
 
 static int do_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
     std::string strPath(path);
-    if (!wadObject->isContent(strPath)) {
-        wadObject->createFile(strPath);
+    std::shared_ptr<Wad> wad = resolve(strPath, strPath);
+    if (wad == nullptr) {
+        return -ENOENT;
+    }
+    if (!wad->isContent(strPath)) {
+        wad->createFile(strPath);
     }
 
-    int bytesWritten = wadObject->writeToFile(strPath, buffer, size, offset);
+    int bytesWritten = wad->writeToFile(strPath, buffer, size, offset);
     if (bytesWritten < 0) {
         return -EIO;
     }
     return bytesWritten;
 }
 
+// a file is only complete once the writer closes it, so that is when dedup looks at it
+static int do_release(const char *path, struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+        return 0;
+    }
+    std::string strPath(path);
+    std::shared_ptr<Wad> wad = resolve(strPath, strPath);
+    if (wad != nullptr && wad->isDedup()) {
+        wad->dedupFile(strPath);
+    }
+    return 0;
+}
+
+// threads started before fuse_main daemonizes would not survive the fork
+static void *do_init(struct fuse_conn_info *conn) {
+    if (archivePool != nullptr) {
+        archivePool->startSweeper();
+    }
+    return fuse_get_context()->private_data;
+}
+
 static struct fuse_operations operations {
     .getattr = do_getattr,
     .mknod = do_mknod,
     .mkdir = do_mkdir,
     .read = do_read,
     .write = do_write,
+    .release = do_release,
     .readdir = do_readdir,  
+    .init = do_init,
 };
 
 int main(int argc, char* argv[]) {
+    // wadfs --dedup-report <wad> prints dedup savings for an existing WAD and exits
+    if (argc == 3 && strcmp(argv[1], "--dedup-report") == 0) {
+        Wad *report = Wad::loadWad(argv[2]);
+        report->printDedupReport();
+        delete report;
+        exit(EXIT_SUCCESS);
+    }
+
+    // wadfs [--dedup] [--reserve BYTES] [--verify] [--budget BYTES] [--idle SECONDS] [fuse options] <wad|dir> <mount>
+    //   --dedup    aliases written files to identical existing lumps when they are closed
+    //   --reserve  keeps BYTES of headroom before the descriptor table so appends don't move it
+    //   --verify   checks lumps against their CRC32C checksums as they are read
+    // Given a directory instead of a WAD, every *.wad in it is served as /<name>/:
+    //   --budget   memory shared by all loaded archives (default 512 MiB)
+    //   --idle     unload archives unused for this many seconds (default 300)
+    bool dedup = false;
+    bool verify = false;
+    size_t reserve = 0;
+    size_t budget = 512UL << 20;
+    time_t idleSeconds = 300;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        int consumed = 1;
+        if (strcmp(argv[1], "--dedup") == 0) {
+            dedup = true;
+        }
+        else if (strcmp(argv[1], "--reserve") == 0 && argc > 2) {
+            reserve = strtoul(argv[2], nullptr, 10);
+            consumed = 2;
+        }
+        else if (strcmp(argv[1], "--verify") == 0) {
+            verify = true;
+        }
+        else if (strcmp(argv[1], "--budget") == 0 && argc > 2) {
+            budget = strtoul(argv[2], nullptr, 10);
+            consumed = 2;
+        }
+        else if (strcmp(argv[1], "--idle") == 0 && argc > 2) {
+            idleSeconds = strtol(argv[2], nullptr, 10);
+            consumed = 2;
+        }
+        else {
+            break;
+        }
+        for (int i = 1; i + consumed < argc; ++i) {
+            argv[i] = argv[i + consumed];
+        }
+        argc -= consumed;
+    }
+
     if (argc < 3) {
         std::cout << "Not enough arguments." << std::endl;
         exit(EXIT_SUCCESS);
@@ -123,7 +486,17 @@ int main(int argc, char* argv[]) {
     if (wadPath.at(0) != '/') {
         wadPath = std::string(get_current_dir_name()) + "/" + wadPath;
     }
-    wadObject = Wad::loadWad(wadPath);
+    struct stat wadStat;
+    if (stat(wadPath.c_str(), &wadStat) == 0 && S_ISDIR(wadStat.st_mode)) {
+        archivePool = new ArchivePool(wadPath, budget, idleSeconds, dedup, reserve, verify);
+        archivePool->scan();
+    }
+    else {
+        wadObject = Wad::loadWad(wadPath);
+        wadObject->setDedup(dedup);
+        wadObject->setReserve(reserve);
+        wadObject->setVerify(verify);
+    }
 
 
 
@@ -132,5 +505,5 @@ int main(int argc, char* argv[]) {
 
 
 
-    return fuse_main(argc, argv, &operations, wadObject);
+    return fuse_main(argc, argv, &operations, archivePool != nullptr ? static_cast<void*>(archivePool) : wadObject);
 }
\ No newline at end of file
@@ -0,0 +1,473 @@
+// wadtool: bulk transfer between a WAD and a directory tree without going through the mount.
+//
+// usage: wadtool extract [-j N] <wad> <dir>
+//        wadtool import [--magic IWAD|PWAD] [--reserve BYTES] <dir> <wad>
+//        wadtool merge <wad>
+//        wadtool scrub [-j N] <wad>
+//
+// extract walks the in-memory tree once and copies lumps with N worker threads
+// (default: one per core), using copy_file_range so the data never leaves the kernel.
+// import builds a fresh WAD in a single pass: lumps are streamed sequentially after a
+// placeholder header, and the descriptor table and header are written once at the end.
+// Directories become NAME_START/NAME_END namespaces (names of at most 2 characters)
+// and E#M# directories become map markers followed by their lumps.
+// --reserve leaves BYTES of headroom before the table for later appends through the mount.
+// merge rewrites every multi-extent lump as one classic contiguous lump.
+// scrub checks every lump against the CRC32C checksums in <wad>.crc with N reader threads,
+// recording checksums for lumps that have none yet. It exits non-zero if any lump is damaged,
+// and refuses to run while wadfs (or another scrub) has the WAD open.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../libWad/Wad.h"
+
+static const size_t COPY_CHUNK = 1 << 20;
+
+static void usage() {
+    std::cout << "usage: wadtool extract [-j N] <wad> <dir>\n"
+              << "       wadtool import [--magic IWAD|PWAD] [--reserve BYTES] <dir> <wad>\n"
+              << "       wadtool merge <wad>\n"
+              << "       wadtool scrub [-j N] <wad>" << std::endl;
+}
+
+// Copies length bytes from in at inOffset to out at outOffset. copy_file_range keeps the
+// copy in the kernel; filesystems that do not support it fall back to pread/pwrite.
+static bool copyRange(int in, off_t inOffset, int out, off_t outOffset, size_t length, std::vector<char> &buffer) {
+    bool useCopyRange = true;
+    while (length > 0) {
+        ssize_t copied = -1;
+        if (useCopyRange) {
+            loff_t from = inOffset;
+            loff_t to = outOffset;
+            copied = copy_file_range(in, &from, out, &to, length, 0);
+            if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                useCopyRange = false;
+                continue;
+            }
+        }
+        else {
+            buffer.resize(COPY_CHUNK);
+            ssize_t got = pread(in, buffer.data(), std::min(length, COPY_CHUNK), inOffset);
+            copied = got > 0 ? pwrite(out, buffer.data(), got, outOffset) : got;
+        }
+        if (copied <= 0) {
+            return false;
+        }
+        inOffset += copied;
+        outOffset += copied;
+        length -= copied;
+    }
+    return true;
+}
+
+struct ExtractJob {
+    std::string path;
+    const Node* node;
+};
+
+// a lump or namespace name is used as one path component, so it must not leave its directory
+static bool isSafeName(const std::string &name) {
+    return !name.empty() && name != "." && name != ".." && name.find('/') == std::string::npos;
+}
+
+// collect directories (created up front, in order) and files (copied in parallel)
+static void collect(const Node* dir, const std::string &path, std::vector<std::string> &dirs,
+                    std::map<std::string, const Node*> &files, size_t &unsafe) {
+    for (const auto &child : dir->children) {
+        std::string name = LumpName::unpack(child->name);
+        if (!isSafeName(name)) {
+            std::cout << "Skipping unsafe name \"" << name << "\" in " << path << std::endl;
+            unsafe++;
+            continue;
+        }
+        std::string childPath = path + "/" + name;
+        if (child->isDirectory) {
+            dirs.push_back(childPath);
+            collect(child.get(), childPath, dirs, files, unsafe);
+        }
+        else {
+            // a later lump with the same name replaces an earlier one, as in the mount
+            files[childPath] = child.get();
+        }
+    }
+}
+
+static int extract(const std::string &wadPath, const std::string &outDir, unsigned threads) {
+    Wad *wad = Wad::loadWad(wadPath);
+    int in = open(wadPath.c_str(), O_RDONLY);
+    if (in < 0) {
+        std::cout << "Cannot open " << wadPath << std::endl;
+        delete wad;
+        return EXIT_FAILURE;
+    }
+
+    // the root snapshot stays valid for the whole extract
+    std::shared_ptr<const Node> root = wad->getRoot();
+    std::vector<std::string> dirs;
+    std::map<std::string, const Node*> fileMap;
+    size_t unsafe = 0;
+    collect(root.get(), outDir, dirs, fileMap, unsafe);
+
+    mkdir(outDir.c_str(), 0755);
+    for (const auto &dir : dirs) {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            std::cout << "Cannot create " << dir << ": " << strerror(errno) << std::endl;
+        }
+    }
+
+    std::vector<ExtractJob> jobs;
+    jobs.reserve(fileMap.size());
+    for (const auto &[path, node] : fileMap) {
+        jobs.push_back({path, node});
+    }
+
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> failures{unsafe};
+    std::atomic<size_t> bytes{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            std::vector<char> buffer;
+            for (size_t i = next++; i < jobs.size(); i = next++) {
+                const ExtractJob &job = jobs[i];
+                int out = open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (out < 0) {
+                    failures++;
+                    continue;
+                }
+                off_t outOffset = 0;
+                for (const auto &extent : job.node->extents) {
+                    if (!copyRange(in, extent.offset, out, outOffset, extent.length, buffer)) {
+                        failures++;
+                        break;
+                    }
+                    outOffset += extent.length;
+                }
+                bytes += job.node->length;
+                close(out);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    close(in);
+    delete wad;
+    std::cout << "Extracted " << jobs.size() << " files (" << bytes << " bytes) and " << dirs.size()
+              << " directories into " << outDir << std::endl;
+    if (failures > 0) {
+        std::cout << failures << " entries failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Streams lumps into a new WAD; descriptors are kept in memory until finish()
+class WadImporter {
+    public:
+    WadImporter(int out) : out(out), offset(12) {}
+
+    bool addLump(const std::string &name, const std::string &sourcePath) {
+        int in = open(sourcePath.c_str(), O_RDONLY);
+        struct stat st;
+        if (in < 0 || fstat(in, &st) != 0) {
+            if (in >= 0) {
+                close(in);
+            }
+            return false;
+        }
+        size_t length = st.st_size;
+        // libWad reads the header's table offset as a signed 32-bit int
+        if (offset + length > INT32_MAX) {
+            close(in);
+            std::cout << "WAD would exceed 2 GiB at " << sourcePath << std::endl;
+            return false;
+        }
+        bool copied = length == 0 || copyRange(in, 0, out, offset, length, buffer);
+        close(in);
+        if (!copied) {
+            return false;
+        }
+        descriptors.emplace_back(LumpName::pack(name), length > 0 ? offset : 0, length);
+        offset += length;
+        return true;
+    }
+
+    void addMarker(uint64_t name) {
+        descriptors.emplace_back(name, 0, 0);
+    }
+
+    bool finish(const std::string &magic, size_t reserve) {
+        // descriptor table goes after the last lump and any headroom, written in one pass
+        size_t tableOffset64 = offset + reserve;
+        if (tableOffset64 + descriptors.size() * 16 > INT32_MAX) {
+            std::cout << "WAD would exceed 2 GiB with the descriptor table" << std::endl;
+            return false;
+        }
+        std::vector<char> table(descriptors.size() * 16);
+        char *slot = table.data();
+        for (const auto &desc : descriptors) {
+            uint32_t lumpOffset = desc.offset;
+            uint32_t lumpLength = desc.length;
+            std::memcpy(slot, &lumpOffset, 4);
+            std::memcpy(slot + 4, &lumpLength, 4);
+            std::memcpy(slot + 8, &desc.name, 8);
+            slot += 16;
+        }
+        if (pwrite(out, table.data(), table.size(), tableOffset64) != static_cast<ssize_t>(table.size())) {
+            return false;
+        }
+
+        char header[12];
+        uint32_t count = descriptors.size();
+        uint32_t tableOffset = tableOffset64;
+        std::memcpy(header, magic.data(), 4);
+        std::memcpy(header + 4, &count, 4);
+        std::memcpy(header + 8, &tableOffset, 4);
+        return pwrite(out, header, 12, 0) == 12;
+    }
+
+    size_t lumpCount() const { return descriptors.size(); }
+
+    private:
+    int out;
+    size_t offset;
+    std::vector<Descriptor> descriptors;
+    std::vector<char> buffer;
+};
+
+static std::vector<std::string> listDirectory(const std::string &path) {
+    std::vector<std::string> entries;
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return entries;
+    }
+    while (struct dirent *entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            entries.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+// map lumps must keep the order the engine expects
+static int mapLumpRank(const std::string &name) {
+    static const char *order[] = {"THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS",
+                                  "SSECTORS", "NODES", "SECTORS", "REJECT", "BLOCKMAP"};
+    for (int i = 0; i < 10; ++i) {
+        if (name == order[i]) {
+            return i;
+        }
+    }
+    return 10;
+}
+
+static bool validLumpName(const std::string &name) {
+    uint64_t key = LumpName::pack(name);
+    return !name.empty() && name.length() <= 8 && !LumpName::containsMapMarker(key) &&
+           name.find("_START") == std::string::npos && name.find("_END") == std::string::npos;
+}
+
+static void importDirectory(WadImporter &importer, const std::string &path, size_t &skipped) {
+    for (const auto &name : listDirectory(path)) {
+        std::string childPath = path + "/" + name;
+        struct stat st;
+        if (stat(childPath.c_str(), &st) != 0) {
+            skipped++;
+            continue;
+        }
+
+        uint64_t key = LumpName::pack(name);
+        if (S_ISDIR(st.st_mode) && name.length() == 4 && LumpName::isMapMarker(key)) {
+            std::vector<std::string> lumps = listDirectory(childPath);
+            std::stable_sort(lumps.begin(), lumps.end(), [](const std::string &a, const std::string &b) {
+                return mapLumpRank(a) < mapLumpRank(b);
+            });
+            // the loader always takes the next 10 descriptors as the map's lumps
+            if (lumps.size() != 10) {
+                std::cout << "Skipping map " << childPath << ": needs exactly 10 lumps" << std::endl;
+                skipped++;
+                continue;
+            }
+            importer.addMarker(key);
+            for (const auto &lump : lumps) {
+                if (lump.length() > 8 || !importer.addLump(lump, childPath + "/" + lump)) {
+                    // keep the map at 10 descriptors with an empty placeholder
+                    std::cout << "Failed to import " << childPath << "/" << lump << std::endl;
+                    importer.addMarker(LumpName::pack(lump));
+                }
+            }
+        }
+        else if (S_ISDIR(st.st_mode)) {
+            if (name.length() > 2) {
+                std::cout << "Skipping directory " << childPath << ": names are at most 2 characters" << std::endl;
+                skipped++;
+                continue;
+            }
+            importer.addMarker(LumpName::concat(key, LumpName::START));
+            importDirectory(importer, childPath, skipped);
+            importer.addMarker(LumpName::concat(key, LumpName::END));
+        }
+        else if (S_ISREG(st.st_mode)) {
+            if (!validLumpName(name) || !importer.addLump(name, childPath)) {
+                std::cout << "Skipping file " << childPath << std::endl;
+                skipped++;
+            }
+        }
+    }
+}
+
+static int import(const std::string &inDir, const std::string &wadPath, const std::string &magic, size_t reserve) {
+    struct stat st;
+    if (stat(inDir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        std::cout << inDir << " is not a directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int out = open(wadPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        std::cout << "Cannot create " << wadPath << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // checksums of whatever WAD was here before no longer apply
+    unlink((wadPath + ".crc").c_str());
+
+    WadImporter importer(out);
+    size_t skipped = 0;
+    importDirectory(importer, inDir, skipped);
+    bool written = importer.finish(magic, reserve);
+    close(out);
+
+    if (!written) {
+        std::cout << "Failed to write " << wadPath << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "Imported " << importer.lumpCount() << " descriptors into " << wadPath;
+    if (skipped > 0) {
+        std::cout << " (" << skipped << " entries skipped)";
+    }
+    std::cout << std::endl;
+    return EXIT_SUCCESS;
+}
+
+static int merge(const std::string &wadPath) {
+    Wad *wad = Wad::loadWad(wadPath);
+    if (!wad->isLoaded()) {
+        std::cout << "Cannot open " << wadPath << std::endl;
+        delete wad;
+        return EXIT_FAILURE;
+    }
+    if (!wad->isExclusive()) {
+        // the other process would keep serving the old descriptor table
+        std::cout << "Cannot merge " << wadPath << " while another process has it open" << std::endl;
+        delete wad;
+        return EXIT_FAILURE;
+    }
+    int merged = wad->mergeExtents();
+    delete wad;
+
+    if (merged < 0) {
+        std::cout << "Some lumps in " << wadPath << " could not be merged" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "Merged " << merged << " multi-extent lumps in " << wadPath << std::endl;
+    return EXIT_SUCCESS;
+}
+
+static int scrub(const std::string &wadPath, unsigned threads) {
+    Wad *wad = Wad::loadWad(wadPath);
+    if (!wad->isLoaded()) {
+        std::cout << "Cannot open " << wadPath << std::endl;
+        delete wad;
+        return EXIT_FAILURE;
+    }
+    bool readOnly = !wad->isExclusive();
+    if (readOnly) {
+        // wadfs (or another scrub) owns the checksum sidecar
+        std::cout << "Scrubbing read-only: blocks without a checksum are not recorded" << std::endl;
+    }
+    ScrubReport report = wad->scrub(threads);
+    delete wad;
+
+    for (const auto &error : report.corrupt) {
+        std::cout << "Checksum mismatch: " << error.name << " (" << error.length << " bytes at offset " << error.offset << ")" << std::endl;
+    }
+    double megabytes = report.bytes / 1048576.0;
+    std::cout << "Scrubbed " << report.blocks << " blocks (" << megabytes << " MiB) in " << report.seconds << " s";
+    if (report.seconds > 0) {
+        std::cout << ", " << megabytes / report.seconds << " MiB/s";
+    }
+    std::cout << "\n"
+              << "Verified:  " << report.verified << "\n"
+              << "Recorded:  " << report.recorded << "\n";
+    if (readOnly) {
+        std::cout << "Unchecked: " << report.unchecked << "\n";
+    }
+    std::cout << "Corrupt:   " << report.corrupt.size() << std::endl;
+    return report.corrupt.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    std::string command = argv[1];
+    std::vector<std::string> args;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string magic = "PWAD";
+    size_t reserve = 0;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--magic" && i + 1 < argc) {
+            magic = argv[++i];
+        }
+        else if (arg == "--reserve" && i + 1 < argc) {
+            reserve = strtoul(argv[++i], nullptr, 10);
+        }
+        else {
+            args.push_back(arg);
+        }
+    }
+
+    if (command == "merge" && args.size() == 1) {
+        return merge(args[0]);
+    }
+    if (command == "scrub" && args.size() == 1) {
+        return scrub(args[0], threads);
+    }
+    if (args.size() != 2 || magic.length() != 4) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (command == "extract") {
+        return extract(args[0], args[1], threads);
+    }
+    if (command == "import") {
+        return import(args[0], args[1], magic, reserve);
+    }
+    usage();
+    return EXIT_FAILURE;
+}